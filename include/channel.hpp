@@ -0,0 +1,93 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "error.hpp"
+#include "event.hpp"
+#include "isocket.hpp"
+
+namespace datapath {
+	/** Typed Channel
+	 * Sends and receives a single trivially copyable type over an existing socket, without going through an
+	 * intermediate std::vector<char> on the sending side. Messages that do not match the size of T are ignored, so
+	 * other traffic can share the socket.
+	 */
+	template<typename T>
+	class channel {
+		static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+		struct state {
+			datapath::event<const T&> on_message;
+		};
+
+		std::shared_ptr<datapath::isocket>                 _socket;
+		std::shared_ptr<state>                             _state;
+		datapath::event<const std::vector<char>&>::token_t _listener;
+
+		public:
+		static constexpr size_t size = sizeof(T);
+
+		public /*events*/:
+		datapath::event<const T&>& on_message;
+
+		public:
+		channel(std::shared_ptr<datapath::isocket> socket)
+			: _socket(socket), _state(std::make_shared<state>()), on_message(_state->on_message)
+		{
+			// Only hold a weak reference, a call that is already in flight may outlive the channel.
+			std::weak_ptr<state> weak = _state;
+			_listener = _socket->on_message.add([weak](const std::vector<char>& data) {
+				if (data.size() != size) {
+					return;
+				}
+				auto obj = weak.lock();
+				if (!obj || !obj->on_message) {
+					return;
+				}
+
+				// Copy into properly aligned storage, the receive buffer makes no alignment guarantees. Raw storage, as
+				// T only has to be trivially copyable, not default constructible.
+				typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+				std::memcpy(&value, data.data(), size);
+				obj->on_message(reinterpret_cast<const T&>(value));
+			});
+		}
+
+		~channel()
+		{
+			_socket->on_message.remove(_listener);
+		}
+
+		channel(const channel<T>&) = delete;
+		channel<T>& operator=(const channel<T>&) = delete;
+
+		inline std::shared_ptr<datapath::isocket> socket()
+		{
+			return _socket;
+		}
+
+		inline datapath::error write(std::shared_ptr<datapath::itask>& task, const T& value)
+		{
+			return _socket->write(task, reinterpret_cast<const char*>(&value), size);
+		}
+	};
+} // namespace datapath
@@ -0,0 +1,159 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+namespace datapath {
+	namespace threadpool {
+		/** CPU Set
+		 * Set of indices without an upper limit, such as workers or logical processors. all() contains every index,
+		 * including ones that do not exist yet, and does not allocate.
+		 */
+		class cpuset {
+			std::vector<uint64_t> _words;
+			bool                  _all;
+
+			public:
+			cpuset() : _all(false) {}
+
+			static inline cpuset all()
+			{
+				cpuset set;
+				set._all = true;
+				return set;
+			}
+
+			static inline cpuset of(size_t index)
+			{
+				cpuset set;
+				set.set(index);
+				return set;
+			}
+
+			inline bool is_all() const
+			{
+				return _all;
+			}
+
+			inline bool empty() const
+			{
+				if (_all) {
+					return false;
+				}
+				for (uint64_t word : _words) {
+					if (word != 0) {
+						return false;
+					}
+				}
+				return true;
+			}
+
+			inline bool test(size_t index) const
+			{
+				if (_all) {
+					return true;
+				}
+				size_t word = index / 64;
+				return (word < _words.size()) && ((_words[word] & (uint64_t(1) << (index % 64))) != 0);
+			}
+
+			inline cpuset& set(size_t index)
+			{
+				if (!_all) {
+					size_t word = index / 64;
+					if (word >= _words.size()) {
+						_words.resize(word + 1, 0);
+					}
+					_words[word] |= uint64_t(1) << (index % 64);
+				}
+				return *this;
+			}
+
+			// Removing an index from all() is not supported, as it would need an unlimited number of bits.
+			inline cpuset& reset(size_t index)
+			{
+				size_t word = index / 64;
+				if (!_all && (word < _words.size())) {
+					_words[word] &= ~(uint64_t(1) << (index % 64));
+				}
+				return *this;
+			}
+
+			// Number of indices, only meaningful if not all().
+			inline size_t count() const
+			{
+				size_t count = 0;
+				for (uint64_t word : _words) {
+					for (; word != 0; word &= word - 1) {
+						count++;
+					}
+				}
+				return count;
+			}
+
+			// Highest index that may be set plus one, only meaningful if not all().
+			inline size_t size() const
+			{
+				return _words.size() * 64;
+			}
+
+			// Bits of the given 64 index wide word, such as a processor group on Windows.
+			inline uint64_t word(size_t index) const
+			{
+				if (_all) {
+					return ~uint64_t(0);
+				}
+				return index < _words.size() ? _words[index] : 0;
+			}
+
+			inline cpuset& operator|=(const cpuset& rhs)
+			{
+				if (rhs._all) {
+					_all = true;
+					_words.clear();
+				} else if (!_all) {
+					if (rhs._words.size() > _words.size()) {
+						_words.resize(rhs._words.size(), 0);
+					}
+					for (size_t idx = 0; idx < rhs._words.size(); idx++) {
+						_words[idx] |= rhs._words[idx];
+					}
+				}
+				return *this;
+			}
+
+			inline bool intersects(const cpuset& rhs) const
+			{
+				if (_all) {
+					return !rhs.empty();
+				} else if (rhs._all) {
+					return !empty();
+				}
+				for (size_t idx = 0; (idx < _words.size()) && (idx < rhs._words.size()); idx++) {
+					if ((_words[idx] & rhs._words[idx]) != 0) {
+						return true;
+					}
+				}
+				return false;
+			}
+		};
+	} // namespace threadpool
+} // namespace datapath
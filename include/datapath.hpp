@@ -26,6 +26,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 namespace datapath {
 	datapath::error connect(std::shared_ptr<datapath::isocket>& socket, std::string path);
 
+	/** Host a server at the given path.
+	 *
+	 * @param max_clients Limit for pipe instances beyond the backlog, 0 to only ever use the backlog.
+	 * @param backlog Pipe instances kept listening for new clients, raise it to absorb bursts of connections.
+	 *                InvalidParameter is returned if 0.
+	 */
 	datapath::error host(std::shared_ptr<datapath::iserver>& server, std::string path,
-						 datapath::permissions permissions, size_t max_clients = 0);
+						 datapath::permissions permissions, size_t max_clients = 0, size_t backlog = 8);
 } // namespace datapath
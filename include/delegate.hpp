@@ -0,0 +1,153 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace datapath {
+	template<typename Signature, size_t Size = 4 * sizeof(void*)>
+	class delegate;
+
+	/** Delegate
+	 * Stores a callable of at most Size bytes inline, so unlike std::function it never allocates. Callables that do
+	 * not fit are rejected at compile time. Arguments are forwarded to the callable without further copies.
+	 */
+	template<typename Return, typename... _args, size_t Size>
+	class delegate<Return(_args...), Size> {
+		enum class operation { Copy, Move, Destroy };
+
+		typedef Return (*invoke_t)(void* storage, _args&&... args);
+		typedef void (*manage_t)(operation op, void* to, void* from);
+
+		mutable typename std::aligned_storage<Size, alignof(std::max_align_t)>::type _storage;
+		invoke_t                                                                    _invoke;
+		manage_t                                                                    _manage;
+
+		template<typename Function>
+		static Return _invoke_fn(void* storage, _args&&... args)
+		{
+			return (*reinterpret_cast<Function*>(storage))(std::forward<_args>(args)...);
+		}
+
+		template<typename Function>
+		static void _manage_fn(operation op, void* to, void* from)
+		{
+			switch (op) {
+			case operation::Copy:
+				new (to) Function(*reinterpret_cast<const Function*>(from));
+				break;
+			case operation::Move:
+				new (to) Function(std::move(*reinterpret_cast<Function*>(from)));
+				break;
+			case operation::Destroy:
+				reinterpret_cast<Function*>(to)->~Function();
+				break;
+			}
+		}
+
+		public:
+		static constexpr size_t size = Size;
+
+		public:
+		delegate() : _invoke(nullptr), _manage(nullptr) {}
+
+		delegate(std::nullptr_t) : delegate() {}
+
+		template<typename Function,
+				 typename = typename std::enable_if<
+					 !std::is_same<typename std::decay<Function>::type, delegate<Return(_args...), Size>>::value>::type>
+		delegate(Function&& fn)
+		{
+			typedef typename std::decay<Function>::type function_t;
+			static_assert(sizeof(function_t) <= Size, "Callable does not fit, increase the size of the delegate");
+			static_assert(alignof(function_t) <= alignof(std::max_align_t), "Callable is over-aligned");
+
+			new (&_storage) function_t(std::forward<Function>(fn));
+			_invoke = &_invoke_fn<function_t>;
+			_manage = &_manage_fn<function_t>;
+		}
+
+		~delegate()
+		{
+			reset();
+		}
+
+		public /* Copy Constructor/Assignment */:
+		delegate(const delegate<Return(_args...), Size>& rhs) : _invoke(rhs._invoke), _manage(rhs._manage)
+		{
+			if (_manage) {
+				_manage(operation::Copy, &_storage, &rhs._storage);
+			}
+		}
+		delegate<Return(_args...), Size>& operator=(const delegate<Return(_args...), Size>& rhs)
+		{
+			if (this != &rhs) {
+				reset();
+				_invoke = rhs._invoke;
+				_manage = rhs._manage;
+				if (_manage) {
+					_manage(operation::Copy, &_storage, &rhs._storage);
+				}
+			}
+			return *this;
+		}
+
+		public /* Move Constructor/Assignment */:
+		delegate(delegate<Return(_args...), Size>&& rhs) : _invoke(rhs._invoke), _manage(rhs._manage)
+		{
+			if (_manage) {
+				_manage(operation::Move, &_storage, &rhs._storage);
+			}
+		}
+		delegate<Return(_args...), Size>& operator=(delegate<Return(_args...), Size>&& rhs)
+		{
+			if (this != &rhs) {
+				reset();
+				_invoke = rhs._invoke;
+				_manage = rhs._manage;
+				if (_manage) {
+					_manage(operation::Move, &_storage, &rhs._storage);
+				}
+			}
+			return *this;
+		}
+
+		public:
+		inline void reset()
+		{
+			if (_manage) {
+				_manage(operation::Destroy, &_storage, nullptr);
+			}
+			_invoke = nullptr;
+			_manage = nullptr;
+		}
+
+		inline explicit operator bool() const
+		{
+			return _invoke != nullptr;
+		}
+
+		inline Return operator()(_args... args) const
+		{
+			return _invoke(&_storage, std::forward<_args>(args)...);
+		}
+	};
+} // namespace datapath
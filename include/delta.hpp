@@ -0,0 +1,105 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cinttypes>
+#include <vector>
+#include "error.hpp"
+#include "event.hpp"
+
+namespace datapath {
+	namespace delta {
+		/** Delta Codec
+		 * Encodes a stream of messages as differences to the previously sent message, which turns a stream of mostly
+		 * identical snapshots into a stream of a few bytes each. Both sides of a channel need their own instance, and
+		 * the encoder/decoder pair must see the exact same sequence of messages.
+		 *
+		 * Frame Layout:
+		 * - uint8_t  Type (Keyframe or Delta)
+		 * - uint32_t Length of the reconstructed message
+		 * - Keyframe: The message itself.
+		 * - Delta: Any number of runs of uint32_t Skip, uint32_t Length and Length bytes XOR'd with the previous
+		 *   message. Skip counts the unchanged bytes before the run, bytes past the end of the previous message are
+		 *   treated as zero.
+		 */
+		enum class frame : uint8_t {
+			Keyframe,
+			Delta,
+		};
+
+		class encoder {
+			std::vector<char> _last;
+			size_t            _keyframe_interval;
+			size_t            _frames_since_keyframe;
+			bool              _force_keyframe;
+
+			public:
+			/** Create a new encoder.
+			 *
+			 * @param keyframe_interval Emit a keyframe at least every this many frames, 0 to only emit keyframes when
+			 *                          a delta would not be smaller.
+			 */
+			encoder(size_t keyframe_interval = 100);
+			~encoder();
+
+			// Force the next frame to be a keyframe, for example after the peer reconnected.
+			void reset();
+
+			datapath::error encode(const char* data, size_t length, std::vector<char>& output);
+
+			inline datapath::error encode(const std::vector<char>& data, std::vector<char>& output)
+			{
+				return encode(data.data(), data.size(), output);
+			}
+		};
+
+		class decoder {
+			std::vector<char> _last;
+			bool              _has_keyframe;
+			size_t            _max_size;
+
+			public /*events*/:
+			// Called with the reconstructed message for every frame passed to push().
+			datapath::event<const std::vector<char>&> on_message;
+
+			public:
+			/** Create a new decoder.
+			 *
+			 * @param max_size Largest message a frame may reconstruct, frames claiming more are rejected before any
+			 *                 memory is allocated for them.
+			 */
+			decoder(size_t max_size = 64 * 1024 * 1024);
+			~decoder();
+
+			// Drop the current base, all deltas until the next keyframe will be rejected.
+			void reset();
+
+			datapath::error decode(const char* data, size_t length, std::vector<char>& output);
+
+			inline datapath::error decode(const std::vector<char>& data, std::vector<char>& output)
+			{
+				return decode(data.data(), data.size(), output);
+			}
+
+			/** Decode a frame and hand the reconstructed message to on_message.
+			 * Can be added directly as a listener to datapath::isocket::on_message.
+			 */
+			datapath::error push(const std::vector<char>& data);
+		};
+	} // namespace delta
+} // namespace datapath
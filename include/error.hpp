@@ -44,5 +44,11 @@ namespace datapath {
 
 		// Operation Not Supported
 		NotSupported,
+
+		// Operation Would Block
+		WouldBlock,
+
+		// Invalid Parameter
+		InvalidParameter,
 	};
 }
@@ -18,103 +18,248 @@
  */
 
 #pragma once
+#include <atomic>
 #include <functional>
-#include <list>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "delegate.hpp"
 
 namespace datapath {
-	template<typename... _args>
-	class event {
-		std::list<std::function<void(_args...)>> _listeners;
+	/** Event
+	 * Listeners are kept in an immutable array which is replaced as a whole whenever a listener is added or removed,
+	 * so calling the event takes no locks and is safe while other threads add or remove listeners. Replaced arrays
+	 * are freed once no call is in flight anymore.
+	 *
+	 * Function is the type listeners are stored as, see event and delegate_event.
+	 */
+	template<typename Function, typename... _args>
+	class basic_event {
+		public:
+		typedef Function function_t;
+
+		// Identifies a listener for removal, 0 is never handed out.
+		typedef size_t token_t;
+
+		private:
+		struct entry {
+			token_t    token;
+			function_t fn;
+		};
+		typedef std::vector<entry> snapshot_t;
+
+		std::mutex               _lock;
+		std::atomic<snapshot_t*> _snapshot;
+		std::atomic<size_t>      _count;
+		std::atomic<size_t>      _callers;
+		std::vector<snapshot_t*> _retired;
+		token_t                  _next_token;
+
+		// Publish a new listener array, _lock must be held.
+		inline void _publish(snapshot_t* snapshot)
+		{
+			snapshot_t* old = _snapshot.exchange(snapshot);
+			_count.store(snapshot ? snapshot->size() : 0);
+			if (old) {
+				_retired.push_back(old);
+			}
+
+			// Callers that start after the exchange can only see the new array.
+			if (_callers.load() == 0) {
+				for (snapshot_t* ptr : _retired) {
+					delete ptr;
+				}
+				_retired.clear();
+			}
+		}
 
 		public:
-		std::function<void(event<_args...>& ptr, std::function<void(_args...)>& fn)> on_add;
-		std::function<void(event<_args...>& ptr, std::function<void(_args...)>& fn)> on_remove;
+		std::function<void(basic_event<Function, _args...>& ptr, function_t& fn)> on_add;
+		std::function<void(basic_event<Function, _args...>& ptr, function_t& fn)> on_remove;
 
 		public:
-		event() : on_add(), on_remove()
-		{
-			_listeners.clear();
-		};
+		basic_event() : _snapshot(nullptr), _count(0), _callers(0), _next_token(0), on_add(), on_remove() {}
 
-		~event()
+		~basic_event()
 		{
 			this->clear();
+			for (snapshot_t* ptr : _retired) {
+				delete ptr;
+			}
 		}
 
 		public /* Copy Constructor/Assignment */:
-		event(const event<_args...>&) = delete;
-		event<_args...>& operator=(const event<_args...>&) = delete;
+		basic_event(const basic_event<Function, _args...>&) = delete;
+		basic_event<Function, _args...>& operator=(const basic_event<Function, _args...>&) = delete;
 
 		public /* Mode Constructor/Assignment */:
-		event(event<_args...>&& rhs)
+		basic_event(basic_event<Function, _args...>&& rhs) : basic_event()
 		{
-			std::swap(_listeners, rhs._listeners);
+			*this = std::move(rhs);
 		}
-		event<_args...>& operator=(event<_args...>&& rhs)
+		basic_event<Function, _args...>& operator=(basic_event<Function, _args...>&& rhs)
 		{
-			std::swap(_listeners, rhs._listeners);
-		};
+			std::unique_lock<std::mutex> ul(_lock);
+			std::unique_lock<std::mutex> ul2(rhs._lock);
+			snapshot_t*                  ptr = rhs._snapshot.exchange(nullptr);
+			rhs._count.store(0);
+			std::swap(_next_token, rhs._next_token);
+			_publish(ptr);
+			return *this;
+		}
 
 		public /* Status */:
 		// Check if empty / no listeners.
-		inline bool empty()
+		inline bool empty() const
 		{
-			return _listeners.empty();
+			return _count.load(std::memory_order_relaxed) == 0;
 		}
 
 		// Convert to bool (true if not empty, false if empty).
-		inline operator bool()
+		inline operator bool() const
 		{
 			return !this->empty();
 		}
 
-		inline size_t count()
+		inline size_t count() const
 		{
-			return _listeners.size();
+			return _count.load(std::memory_order_relaxed);
 		}
 
 		public /* Listeners */:
-		// Add new listener.
-		inline void add(std::function<void(_args...)> listener)
+		// Add new listener, the returned token removes it again.
+		inline token_t add(function_t listener)
 		{
 			if (on_add)
 				on_add(*this, listener);
-			_listeners.push_back(listener);
+
+			std::unique_lock<std::mutex> ul(_lock);
+			snapshot_t*                  current  = _snapshot.load();
+			snapshot_t*                  snapshot = current ? new snapshot_t(*current) : new snapshot_t();
+			token_t                      token    = ++_next_token;
+			snapshot->push_back(entry{token, std::move(listener)});
+			_publish(snapshot);
+			return token;
 		}
-		inline event<_args...>& operator+=(std::function<void(_args...)> listener)
+		inline basic_event<Function, _args...>& operator+=(function_t listener)
 		{
-			this->add(listener);
+			this->add(std::move(listener));
 			return *this;
 		}
 
 		// Remove existing listener.
-		inline void remove(std::function<void(_args...)> listener)
+		inline void remove(token_t token)
 		{
-			_listeners.remove(listener);
+			function_t fn;
+			{
+				std::unique_lock<std::mutex> ul(_lock);
+				snapshot_t*                  current = _snapshot.load();
+				if (!current) {
+					return;
+				}
+
+				snapshot_t* snapshot = new snapshot_t();
+				snapshot->reserve(current->size());
+				for (const entry& l : *current) {
+					if (l.token == token) {
+						fn = l.fn;
+					} else {
+						snapshot->push_back(l);
+					}
+				}
+				if (!fn) {
+					delete snapshot;
+					return;
+				}
+				_publish(snapshot);
+			}
 			if (on_remove)
-				on_remove(*this, listener);
+				on_remove(*this, fn);
 		}
-		inline event<_args...>& operator-=(std::function<void(_args...)> listener)
+		inline basic_event<Function, _args...>& operator-=(token_t token)
 		{
-			this->remove(listener);
+			this->remove(token);
 			return *this;
 		}
 
 		// Remove all listeners.
 		inline void clear()
 		{
-			_listeners.clear();
+			std::unique_lock<std::mutex> ul(_lock);
+			_publish(nullptr);
 		}
 
 		public /* Calling */:
-		// Call Listeners with arguments.
-		template<typename... _largs>
-		inline void operator()(_args... args)
+		// Call Listeners with arguments, which are passed on by reference.
+		template<typename... _cargs>
+		inline void operator()(_cargs&&... args)
 		{
-			/// Not valid without the extra template.
-			for (auto& l : _listeners) {
-				l(args...);
+			_callers.fetch_add(1);
+			snapshot_t* snapshot = _snapshot.load();
+			if (snapshot) {
+				for (const entry& l : *snapshot) {
+					l.fn(args...);
+				}
 			}
+			_callers.fetch_sub(1);
+		}
+	};
+
+	// Event with listeners stored as std::function, which accepts any callable.
+	template<typename... _args>
+	using event = basic_event<std::function<void(_args...)>, _args...>;
+
+	// Event with listeners stored inline as delegates, which never allocates but limits the size of captures.
+	template<typename... _args>
+	using delegate_event = basic_event<datapath::delegate<void(_args...)>, _args...>;
+
+	/** Static Event
+	 * Calls a fixed set of handlers that is known at compile time, so the calls can be inlined into the caller. Use
+	 * make_static_event() to create one from lambdas.
+	 */
+	template<typename... Handlers>
+	class static_event {
+		std::tuple<Handlers...> _handlers;
+
+		template<size_t... _idx, typename... _cargs>
+		inline void _call(std::index_sequence<_idx...>, _cargs&... args)
+		{
+			int expand[] = {0, ((void)std::get<_idx>(_handlers)(args...), 0)...};
+			(void)expand;
+		}
+
+		public:
+		static_event(Handlers... handlers) : _handlers(std::move(handlers)...) {}
+
+		public /* Status */:
+		inline bool empty() const
+		{
+			return sizeof...(Handlers) == 0;
+		}
+
+		inline operator bool() const
+		{
+			return !this->empty();
+		}
+
+		inline size_t count() const
+		{
+			return sizeof...(Handlers);
+		}
+
+		public /* Calling */:
+		// Call Handlers in order with arguments, which are passed on by reference.
+		template<typename... _cargs>
+		inline void operator()(_cargs&&... args)
+		{
+			_call(std::index_sequence_for<Handlers...>(), args...);
 		}
 	};
+
+	template<typename... Handlers>
+	inline static_event<typename std::decay<Handlers>::type...> make_static_event(Handlers&&... handlers)
+	{
+		return static_event<typename std::decay<Handlers>::type...>(std::forward<Handlers>(handlers)...);
+	}
 }; // namespace datapath
@@ -18,11 +18,21 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
 #include <memory>
+#include "cpuset.hpp"
 #include "error.hpp"
 #include "event.hpp"
 #include "isocket.hpp"
 
 namespace datapath {
+	enum class reactor_policy : int8_t {
+		// Connections go to the reactor with the fewest connections, and move off reactors that read far more
+		// messages than the others.
+		LeastLoaded,
+
+		// Connections go to a reactor picked by a hash of the connection, and stay there.
+		Hash,
+	};
+
 	class iserver {
 		public /*event*/:
 
@@ -37,5 +47,24 @@ namespace datapath {
 
 		public:
 		virtual datapath::error close() = 0;
+
+		// Message size limit applied to every accepted socket, see isocket::set_max_message_size.
+		virtual void set_max_message_size(size_t                    size,
+										  datapath::oversize_policy policy = datapath::oversize_policy::Close) = 0;
+
+		// Where listeners of every accepted socket run, see isocket::set_dispatch.
+		virtual void set_dispatch(datapath::dispatch_mode                     mode,
+								  std::shared_ptr<datapath::threadpool::pool> pool = nullptr) = 0;
+
+		/** Choose the threads that read from accepted sockets.
+		 * By default accepted sockets are read by a shared set of reactor threads, one per core, and connected sockets
+		 * by a single shared reactor thread. This gives the server reactors of its own, one per core that has any of
+		 * the given processors and pinned to it. Only sockets accepted afterwards use them.
+		 *
+		 * @param processors Logical processors to run reactors on, throws std::invalid_argument if none exist.
+		 * @param policy How accepted sockets are spread over the reactors.
+		 */
+		virtual void set_reactors(const datapath::threadpool::cpuset& processors,
+								  datapath::reactor_policy policy = datapath::reactor_policy::LeastLoaded) = 0;
 	};
 } // namespace datapath
@@ -17,22 +17,182 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #pragma once
+#include <chrono>
+#include <memory>
+#include <vector>
 #include "error.hpp"
 #include "event.hpp"
 #include "itask.hpp"
 
 namespace datapath {
+	namespace threadpool {
+		class pool;
+	}
+
+	enum class write_mode : int8_t {
+		// Always issue writes asynchronously, completion is signaled to the writing thread.
+		Queued,
+
+		// Attempt to complete the write within the call, anything not written is left to the system.
+		Opportunistic,
+	};
+
+	enum class oversize_policy : int8_t {
+		// Close the connection, the peer is misbehaving.
+		Close,
+
+		// Discard the message and continue with the next one.
+		Skip,
+
+		// Hand the message to on_message_part in pieces no larger than the limit.
+		Stream,
+	};
+
+	// Message size limit of sockets that were not given one.
+	static const size_t default_max_message = 64 * 1024 * 1024;
+
+	enum class dispatch_mode : int8_t {
+		// Listeners run on the thread reading the socket, a slow listener delays further reads.
+		Inline,
+
+		// Listeners run on a thread pool, one at a time and in the order the messages arrived.
+		Serialized,
+
+		// Listeners run on a thread pool, several at once and in any order.
+		Parallel,
+	};
+
+	struct watermark {
+		// Number of bytes queued for sending, 0 for no limit.
+		size_t bytes;
+
+		// Number of messages queued for sending, 0 for no limit.
+		size_t messages;
+	};
+
+	// A received message, only valid for the duration of the callback it was handed to.
+	struct message_view {
+		const char* data;
+		size_t      size;
+	};
+
 	class isocket {
 		public /*events*/:
 		datapath::event<const std::vector<char>&> on_message;
 
 		datapath::event<> on_close;
 
+		/** Message Part Event
+		 * Called for messages above the size limit if the oversize policy is Stream.
+		 *
+		 * @param const std::vector<char>& Part of the message.
+		 * @param size_t Offset of the part in the message.
+		 * @param size_t Total size of the message.
+		 */
+		datapath::event<const std::vector<char>&, size_t, size_t> on_message_part;
+
+		/** Writable Event
+		 * Called once the send queue drained to the low watermark after try_write() returned WouldBlock.
+		 */
+		datapath::event<> on_writable;
+
+		/** Message Batch Event
+		 * Called with every message that has arrived so far, in order, instead of calling on_message once per
+		 * message. While this has listeners, messages are no longer delivered to on_message.
+		 *
+		 * @param const message_view* Messages, backed by a single buffer owned by the socket.
+		 * @param size_t Number of messages.
+		 */
+		datapath::event<const datapath::message_view*, size_t> on_message_batch;
+
 		public:
 		virtual bool good() = 0;
 
 		virtual datapath::error close() = 0;
 
-		virtual datapath::error write(std::shared_ptr<datapath::itask>& task, const std::vector<char>& data) = 0;
+		virtual void set_write_mode(datapath::write_mode mode) = 0;
+
+		/** Limit the size of received messages.
+		 * The limit is checked against the header before any memory is allocated for the message.
+		 *
+		 * Sockets start out with a limit of default_max_message.
+		 *
+		 * @param size Largest allowed message in bytes, 0 for no limit.
+		 * @param policy What to do with messages above the limit.
+		 */
+		virtual void set_max_message_size(size_t                    size,
+										  datapath::oversize_policy policy = datapath::oversize_policy::Close) = 0;
+
+		/** Limit the send queue for try_write().
+		 *
+		 * @param high try_write() returns WouldBlock while the queue would grow past this.
+		 * @param low on_writable is called once the queue drained to this.
+		 */
+		virtual void set_write_watermarks(datapath::watermark high, datapath::watermark low) = 0;
+
+		/** Enable credit based flow control for messages received on this socket.
+		 * The peer may only send as many bytes and messages as were granted to it, and is granted more once
+		 * on_message returned for them. While out of credit, write() and try_write() on the peer return WouldBlock and
+		 * on_writable is called once credit arrives. A single message may exceed the remaining byte credit, so the
+		 * window bounds buffering to window + one message.
+		 *
+		 * @param window Credit to grant, 0 in both fields disables flow control again.
+		 */
+		virtual void set_flow_control(datapath::watermark window) = 0;
+
+		/** Choose where on_message, on_message_batch and on_close listeners run.
+		 * Messages handed to a thread pool get a buffer of their own, and count as consumed for flow control once
+		 * they are handed over.
+		 *
+		 * @param mode Where listeners run.
+		 * @param pool Thread pool for Serialized and Parallel, listeners run inline without one.
+		 */
+		virtual void set_dispatch(datapath::dispatch_mode                     mode,
+								  std::shared_ptr<datapath::threadpool::pool> pool = nullptr) = 0;
+
+		// Returns InvalidParameter for messages of 2 GiB or more, which the framing can not describe.
+		virtual datapath::error write(std::shared_ptr<datapath::itask>& task, const char* data, size_t length) = 0;
+
+		inline datapath::error write(std::shared_ptr<datapath::itask>& task, const std::vector<char>& data)
+		{
+			return write(task, data.data(), data.size());
+		}
+
+		// Same as write(), but returns WouldBlock instead of queueing past the high watermark.
+		virtual datapath::error try_write(std::shared_ptr<datapath::itask>& task, const char* data,
+										  size_t length) = 0;
+
+		inline datapath::error try_write(std::shared_ptr<datapath::itask>& task, const std::vector<char>& data)
+		{
+			return try_write(task, data.data(), data.size());
+		}
+
+		/** Receive the next message on the calling thread.
+		 * Only available while nothing listens to on_message or on_message_batch, as messages are otherwise delivered
+		 * there. Control traffic such as flow control credit is processed as part of this call.
+		 *
+		 * @param buffer Caller owned buffer, resized to fit the message.
+		 * @param timeout How long to wait for a message.
+		 * @return Success, TimedOut, Closed, or NotSupported if on_message or on_message_batch have listeners.
+		 */
+		virtual datapath::error receive(std::vector<char>&       buffer,
+										std::chrono::nanoseconds timeout = std::chrono::nanoseconds(0)) = 0;
+
+		/** Receive up to capacity messages on the calling thread.
+		 * Waits up to timeout for the first message, then takes whatever else has already arrived.
+		 *
+		 * @param buffers Caller owned buffers, each resized to fit one message.
+		 * @param capacity Number of buffers.
+		 * @param count Number of messages received.
+		 * @param timeout How long to wait for the first message.
+		 */
+		virtual datapath::error receive_batch(std::vector<char>* buffers, size_t capacity, size_t& count,
+											  std::chrono::nanoseconds timeout = std::chrono::nanoseconds(0)) = 0;
+
+		inline datapath::error receive_batch(std::vector<std::vector<char>>& buffers, size_t& count,
+											 std::chrono::nanoseconds timeout = std::chrono::nanoseconds(0))
+		{
+			return receive_batch(buffers.data(), buffers.size(), count, timeout);
+		}
 	};
 } // namespace datapath
@@ -0,0 +1,100 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "event.hpp"
+#include "isocket.hpp"
+
+namespace datapath {
+	/** Message Router
+	 * Hands each message only to the handlers registered for its type, instead of every listener looking at every
+	 * message. The type is looked up in a flat table sized at construction, so routing a message costs one index
+	 * regardless of how many types and handlers there are. By default the type is the first two bytes of the
+	 * message, in native byte order.
+	 */
+	class router {
+		public:
+		typedef uint16_t                                          type_t;
+		typedef datapath::event<const datapath::message_view&>    handlers_t;
+		typedef handlers_t::token_t                               token_t;
+		typedef std::function<bool(const char*, size_t, type_t&)> extractor_t;
+
+		private:
+		// Shared with socket listeners, so a call that is already in flight may outlive the router.
+		struct state {
+			std::vector<handlers_t> handlers;
+			extractor_t             extractor;
+			handlers_t              on_unhandled;
+
+			state(size_t types);
+
+			void route(const char* data, size_t size);
+		};
+
+		std::shared_ptr<state> _state;
+
+		std::mutex                                                        _lock;
+		std::vector<std::pair<std::weak_ptr<datapath::isocket>, token_t>> _sockets;
+
+		public /*events*/:
+		// Called for messages without a type, or with a type that has no handlers.
+		handlers_t& on_unhandled;
+
+		public:
+		/** Create a router.
+		 *
+		 * @param types Number of message types, types at or above this are never routed to a handler.
+		 */
+		router(size_t types = 256);
+		~router();
+
+		router(const router&) = delete;
+		router& operator=(const router&) = delete;
+
+		/** Replace how the type is read from a message.
+		 * Must be set before the router sees any messages.
+		 *
+		 * @param extractor Returns false if the message has no type, otherwise stores the type.
+		 */
+		void set_extractor(extractor_t extractor);
+
+		// Add a handler for a message type, throws std::out_of_range if the type is not covered by the table.
+		token_t add(type_t type, handlers_t::function_t handler);
+
+		void remove(type_t type, token_t token);
+
+		// Route a message to the handlers of its type.
+		void route(const char* data, size_t size);
+
+		inline void route(const std::vector<char>& data)
+		{
+			route(data.data(), data.size());
+		}
+
+		// Route all messages of a socket until it is detached again or the router is destroyed.
+		void attach(std::shared_ptr<datapath::isocket> socket);
+
+		void detach(std::shared_ptr<datapath::isocket> socket);
+	};
+} // namespace datapath
@@ -18,56 +18,402 @@
  */
 
 #pragma once
-#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <functional>
-#include <list>
-#include <map>
-#include <mutex>
-#include <queue>
-#include <thread>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "cpuset.hpp"
 #include "error.hpp"
+#include "topology.hpp"
 
 namespace datapath {
 	namespace threadpool {
-		typedef uint64_t affinity_t;
+		// Set of worker indices a task may run on.
+		typedef datapath::threadpool::cpuset affinity_t;
 
-		constexpr affinity_t default_mask = std::numeric_limits<affinity_t>::max();
+		static const affinity_t default_mask = affinity_t::all();
+
+		typedef std::chrono::steady_clock::time_point deadline_t;
+
+		static const deadline_t no_deadline = deadline_t::max();
+
+		enum class priority : int8_t {
+			// Runs before normal and low priority tasks, as if its deadline was the time it was pushed.
+			High,
+
+			// Runs in the order it was pushed.
+			Normal,
+
+			// Runs when there is nothing else to do, or once it waited longer than options::aging.
+			Low,
+		};
 
 		struct task {
-			std::function<void()> function;
-			affinity_t            mask = default_mask;
+			std::function<void()>          function;
+			affinity_t                     mask     = default_mask;
+			datapath::threadpool::priority priority = datapath::threadpool::priority::Normal;
+
+			// Tasks with a deadline run earliest deadline first, ahead of tasks without one.
+			deadline_t deadline = no_deadline;
 		};
 
-		class pool {
-			struct worker {
-				affinity_t affinity;
-				bool       should_stop = false;
+		enum class placement : int8_t {
+			// One worker per logical processor, pinned to it.
+			LogicalCore,
+
+			// One worker per physical core, pinned to all of its logical processors.
+			PhysicalCore,
+
+			// One worker per logical processor, pinned to the NUMA node of that processor.
+			Node,
+		};
+
+		// How push() picks a worker for tasks pushed from outside the pool.
+		enum class policy : int8_t {
+			// Worker with the shortest queue, looks at every worker.
+			LeastLoaded,
+
+			// Worker with the shorter queue out of two random ones.
+			PowerOfTwo,
+
+			// Same worker for every push from a thread, threads are spread over the workers.
+			Local,
+		};
+
+		struct options {
+			datapath::threadpool::placement placement = datapath::threadpool::placement::LogicalCore;
+
+			datapath::threadpool::policy policy = datapath::threadpool::policy::PowerOfTwo;
+
+			// Prefer workers on the NUMA node of the pushing thread, and steal from the same node first.
+			bool node_local = false;
+
+			// Low priority tasks that waited this long run ahead of normal priority tasks.
+			std::chrono::nanoseconds aging = std::chrono::milliseconds(10);
+
+			// How long an idle worker keeps looking for work before it goes to sleep, 0 to sleep right away.
+			std::chrono::nanoseconds spin = std::chrono::microseconds(50);
+
+			// Workers started right away, which never stop.
+			size_t min_workers = 0;
+
+			// Most workers, 0 for one per processor or core as given by placement.
+			size_t max_workers = 0;
+
+			// Another worker is started once every running worker was busy for this long while tasks were pushed.
+			std::chrono::nanoseconds grow_latency = std::chrono::microseconds(100);
+
+			// Workers beyond min_workers stop after being idle for this long, 0 to keep them.
+			std::chrono::nanoseconds idle_timeout = std::chrono::seconds(10);
+		};
+
+		class pool;
+
+		/** Task Graph Handle
+		 * Refers to a task submitted with pool::submit(), which runs once every task it was submitted after is done.
+		 */
+		class handle {
+			public:
+			struct node;
+
+			private:
+			std::shared_ptr<node> _node;
+
+			public:
+			handle() = default;
+			handle(std::shared_ptr<node> node);
+
+			bool valid() const;
+
+			bool done() const;
+
+			// Wait for the task to finish. Workers of the same pool run other tasks while waiting.
+			void wait() const;
+
+			// Submit a task to the same pool that runs after this one.
+			handle then(std::function<void()> function, const affinity_t& mask = default_mask) const;
+
+			friend class datapath::threadpool::pool;
+		};
 
-				std::thread thread;
+		void wait_all(const std::vector<datapath::threadpool::handle>& handles);
 
-				std::mutex                        mutex;
-				std::queue<std::shared_ptr<task>> queue;
-				std::condition_variable           signal;
+		/** Thread Pool
+		 * Every worker owns a work stealing deque for tasks pushed from inside the pool, and an inbox for tasks pushed
+		 * from other threads or restricted to it by their mask. Idle workers steal from random other workers, but only
+		 * tasks that may run on any worker.
+		 *
+		 * Tasks with a deadline or high priority are kept apart and run earliest deadline first, before anything else.
+		 * Idle workers steal those first, so they do not wait behind a long task on a busy worker. Low priority tasks
+		 * only run when there is nothing else, unless they waited longer than options::aging.
+		 *
+		 * Threads are started as needed: when nothing runs yet, when every running worker stays busy for longer than
+		 * options::grow_latency, or when a task is pushed to a specific worker. Idle threads stop again after
+		 * options::idle_timeout.
+		 */
+		class pool {
+			// Task as it is queued, small callables are stored inline. Jobs live in pooled slots that are cached per
+			// thread, so submitting a small callable does not allocate.
+			struct job {
+				static constexpr size_t inline_size = 32;
+
+				typedef typename std::aligned_storage<inline_size, alignof(void*)>::type storage_t;
 
-				worker(affinity_t affinity);
-				~worker();
+				void (*invoke)(job* self);
+				void (*destroy)(job* self);
+				bool stealable;
 
-				void runner();
+				// Queue the job goes into, High for everything with a deadline.
+				datapath::threadpool::priority priority;
 
-				void clear();
+				// When it has to run, or for Low when it stops waiting for normal tasks.
+				deadline_t deadline;
 
-				void push(std::shared_ptr<task> task);
+				storage_t storage;
 			};
 
-			std::map<affinity_t, std::shared_ptr<worker>> _workers;
+			struct worker;
+
+			datapath::threadpool::options        _options;
+			std::vector<std::shared_ptr<worker>> _workers;
+			std::vector<worker*>                 _everyone;
+			std::vector<std::vector<worker*>>    _nodes;
+			std::atomic<size_t>                  _sleeping;
+			std::atomic<size_t>                  _searching;
+			std::atomic<bool>                    _waking;
+			std::atomic<size_t>                  _active;
+			std::atomic<int64_t>                 _backlog;
+			std::atomic<size_t>                  _next;
+
+			static worker*& _current();
+
+			static job* _acquire();
+
+			static void _release(job* job);
+
+			static void _run(std::shared_ptr<datapath::threadpool::handle::node> node);
+
+			void _schedule(std::shared_ptr<datapath::threadpool::handle::node> node);
+
+			void _wake_one();
+
+			void _grow(size_t count);
+
+			void _check_backlog(size_t pending = 1);
+
+			bool _submit(job* job, const affinity_t& mask, bool sticky = false, size_t key = 0);
+
+			void _submit_bulk(job** jobs, size_t count);
+
+			void _prioritize(job* job);
+
+			size_t _chunk_size(size_t count, size_t grain) const;
+
+			void _parallel(size_t count, size_t size, const std::function<void(size_t, size_t, size_t)>& body);
+
+			template<typename Callable>
+			static void _invoke_inline(job* self)
+			{
+				(*reinterpret_cast<Callable*>(&self->storage))();
+			}
+
+			template<typename Callable>
+			static void _destroy_inline(job* self)
+			{
+				reinterpret_cast<Callable*>(&self->storage)->~Callable();
+			}
+
+			template<typename Callable>
+			static void _invoke_boxed(job* self)
+			{
+				(**reinterpret_cast<Callable**>(&self->storage))();
+			}
+
+			template<typename Callable>
+			static void _destroy_boxed(job* self)
+			{
+				delete *reinterpret_cast<Callable**>(&self->storage);
+			}
+
+			template<typename Callable, typename Function>
+			static void _construct(job* self, Function&& function, std::true_type /* fits inline */)
+			{
+				new (&self->storage) Callable(std::forward<Function>(function));
+				self->invoke  = &_invoke_inline<Callable>;
+				self->destroy = &_destroy_inline<Callable>;
+			}
+
+			template<typename Callable, typename Function>
+			static void _construct(job* self, Function&& function, std::false_type /* fits inline */)
+			{
+				*reinterpret_cast<Callable**>(&self->storage) = new Callable(std::forward<Function>(function));
+				self->invoke                                  = &_invoke_boxed<Callable>;
+				self->destroy                                 = &_destroy_boxed<Callable>;
+			}
+
+			template<typename Callable>
+			static job* _make(Callable&& function, datapath::threadpool::priority priority, deadline_t deadline)
+			{
+				typedef typename std::decay<Callable>::type callable_t;
+				typedef std::integral_constant<bool, (sizeof(callable_t) <= job::inline_size)
+														 && (alignof(callable_t) <= alignof(typename job::storage_t))>
+					fits_t;
+
+				job* my_job = _acquire();
+				_construct<callable_t>(my_job, std::forward<Callable>(function), fits_t());
+				my_job->priority = priority;
+				my_job->deadline = deadline;
+				return my_job;
+			}
 
 			public:
-			pool();
+			pool(const datapath::threadpool::options& options = datapath::threadpool::options());
 			~pool();
 
 			bool push(std::shared_ptr<task> task);
 
-			void clear(affinity_t mask = default_mask);
+			/** Push a callable without going through task.
+			 * Callables up to 32 bytes are stored in the queued job itself, which makes this allocation free.
+			 *
+			 * @param function Callable taking no arguments.
+			 * @param mask Workers the callable may run on, throws std::invalid_argument if it matches none.
+			 * @return false if no worker is available.
+			 */
+			template<typename Callable>
+			inline bool push(Callable&& function, const affinity_t& mask = default_mask)
+			{
+				return _submit(
+					_make(std::forward<Callable>(function), datapath::threadpool::priority::Normal, no_deadline),
+					mask);
+			}
+
+			/** Push a callable with a priority and deadline.
+			 *
+			 * @param function Callable taking no arguments.
+			 * @param priority Priority class, ignored if there is a deadline.
+			 * @param deadline Time by which it should run, tasks with a deadline run earliest deadline first.
+			 * @param mask Workers the callable may run on.
+			 */
+			template<typename Callable>
+			inline bool push(Callable&& function, datapath::threadpool::priority priority,
+							 deadline_t deadline = no_deadline, const affinity_t& mask = default_mask)
+			{
+				return _submit(_make(std::forward<Callable>(function), priority, deadline), mask);
+			}
+
+			/** Push many tasks at once.
+			 * Tasks are split evenly across the workers, and each worker is locked and woken once for its share.
+			 * Tasks with a restricted mask are pushed one by one.
+			 *
+			 * @param tasks Tasks to push, none may be nullptr.
+			 * @param count Number of tasks.
+			 */
+			bool push_bulk(const std::shared_ptr<task>* tasks, size_t count);
+
+			inline bool push_bulk(const std::vector<std::shared_ptr<task>>& tasks)
+			{
+				return push_bulk(tasks.data(), tasks.size());
+			}
+
+			/** Call a function for every index in [begin, end) and wait for it.
+			 * The range is split into chunks that workers and the calling thread take as they get to them. If the
+			 * function throws, chunks not started yet are skipped and the first exception is rethrown here.
+			 *
+			 * @param function Callable taking the index.
+			 * @param grain Indices per chunk, 0 to pick a few chunks per worker.
+			 */
+			template<typename Function>
+			void parallel_for(size_t begin, size_t end, Function&& function, size_t grain = 0)
+			{
+				if (end <= begin) {
+					return;
+				}
+
+				_parallel(end - begin, _chunk_size(end - begin, grain),
+						  [&function, begin](size_t, size_t first, size_t last) {
+							  for (size_t idx = begin + first; idx < begin + last; idx++) {
+								  function(idx);
+							  }
+						  });
+			}
+
+			/** Combine the results of a function for every index in [begin, end).
+			 * Chunks are combined in order, so reduce only has to be associative. Exceptions are handled like in
+			 * parallel_for.
+			 *
+			 * @param identity Starting value of every chunk.
+			 * @param function Callable taking the index and returning a T.
+			 * @param reduce Callable combining two T into one.
+			 * @param grain Indices per chunk, 0 to pick a few chunks per worker.
+			 */
+			template<typename T, typename Function, typename Reduce>
+			T parallel_reduce(size_t begin, size_t end, T identity, Function&& function, Reduce&& reduce,
+							  size_t grain = 0)
+			{
+				if (end <= begin) {
+					return identity;
+				}
+
+				// Wrapped, as std::vector<bool> can not be written to from several threads.
+				struct partial {
+					T value;
+				};
+
+				size_t               size = _chunk_size(end - begin, grain);
+				std::vector<partial> partials(((end - begin) + size - 1) / size, partial{identity});
+				_parallel(end - begin, size, [&](size_t chunk, size_t first, size_t last) {
+					T value = identity;
+					for (size_t idx = begin + first; idx < begin + last; idx++) {
+						value = reduce(std::move(value), function(idx));
+					}
+					partials[chunk].value = std::move(value);
+				});
+
+				T result = identity;
+				for (auto& obj : partials) {
+					result = reduce(std::move(result), std::move(obj.value));
+				}
+				return result;
+			}
+
+			/** Push a callable to the worker that belongs to a key.
+			 * Everything pushed with the same key runs on the same worker and is never stolen, which keeps the data
+			 * it works on in that worker's cache.
+			 *
+			 * @param key Any value, such as the address of the object the callable works on.
+			 * @param function Callable taking no arguments.
+			 * @param mask Workers the key may map to.
+			 */
+			template<typename Callable>
+			inline bool push_sticky(size_t key, Callable&& function, const affinity_t& mask = default_mask)
+			{
+				return _submit(
+					_make(std::forward<Callable>(function), datapath::threadpool::priority::Normal, no_deadline),
+					mask, true, key);
+			}
+
+			/** Submit a task that runs after other tasks.
+			 * Once the last of them is done, the task runs right away on the same worker if its mask allows, instead
+			 * of going through a queue.
+			 *
+			 * @param function Function to run.
+			 * @param after Tasks that have to be done first, empty handles are ignored.
+			 * @param mask Workers the task may run on, throws std::invalid_argument if it matches none.
+			 */
+			datapath::threadpool::handle submit(
+				std::function<void()>                            function,
+				const std::vector<datapath::threadpool::handle>& after = std::vector<datapath::threadpool::handle>(),
+				const affinity_t&                                mask  = default_mask);
+
+			void clear(const affinity_t& mask = default_mask);
+
+			friend class datapath::threadpool::handle;
 		};
 	} // namespace threadpool
 } // namespace datapath
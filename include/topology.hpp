@@ -0,0 +1,93 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+#include "cpuset.hpp"
+
+namespace datapath {
+	namespace threadpool {
+		struct processor {
+			// Logical processor, on Windows this is group * 64 + number within the group.
+			size_t id;
+
+			// Physical core, shared by SMT siblings. Numbered across all packages.
+			size_t core;
+
+			size_t package;
+
+			// NUMA node.
+			size_t node;
+		};
+
+		/** Processor Topology
+		 * Logical processors this process may run on, and the cores, packages and NUMA nodes they belong to. Read
+		 * from /sys/devices/system on Linux and GetLogicalProcessorInformationEx on Windows. Elsewhere every logical
+		 * processor is treated as its own core on a single node.
+		 */
+		class topology {
+			std::vector<datapath::threadpool::processor> _processors;
+			std::vector<size_t>                          _index;
+			size_t                                       _cores;
+			size_t                                       _packages;
+			size_t                                       _nodes;
+
+			void _finish();
+
+			public:
+			topology();
+
+			inline const std::vector<datapath::threadpool::processor>& processors() const
+			{
+				return _processors;
+			}
+
+			inline size_t cores() const
+			{
+				return _cores;
+			}
+
+			inline size_t packages() const
+			{
+				return _packages;
+			}
+
+			inline size_t nodes() const
+			{
+				return _nodes;
+			}
+
+			// Processor with the given id, or nullptr if this process may not run on it.
+			const datapath::threadpool::processor* find(size_t id) const;
+
+			// NUMA node of the processor the calling thread is running on right now.
+			size_t current_node() const;
+
+			// Topology of this machine, detected once.
+			static const datapath::threadpool::topology& instance();
+
+			/** Restrict the calling thread to a set of logical processors.
+			 * On Windows a thread can only run in one processor group, so only the first group that has any of the
+			 * processors is used. Does nothing if the set is empty or all().
+			 */
+			static void pin(const datapath::threadpool::cpuset& processors);
+		};
+	} // namespace threadpool
+} // namespace datapath
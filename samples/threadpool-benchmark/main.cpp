@@ -0,0 +1,222 @@
+/*
+Sample for DataPath
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "threadpool.hpp"
+
+// Compares how the threadpool places tasks pushed from several threads at once.
+
+static const size_t submitters = 4;
+
+struct result {
+	double submit_ns;
+	double total_ms;
+};
+
+static result run(datapath::threadpool::policy policy, bool sticky, size_t tasks, size_t work)
+{
+	datapath::threadpool::options options;
+	options.policy = policy;
+	datapath::threadpool::pool pool(options);
+
+	std::atomic<size_t>   done(0);
+	std::atomic<uint64_t> submit_time(0);
+	std::atomic<uint64_t> sink(0);
+
+	auto task = [&done, &sink, work]() {
+		uint64_t value = 0;
+		for (size_t idx = 0; idx < work; idx++) {
+			value = value * 6364136223846793005ull + 1442695040888963407ull;
+		}
+		sink.fetch_add(value, std::memory_order_relaxed);
+		done.fetch_add(1, std::memory_order_release);
+	};
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::thread> threads;
+	for (size_t thread = 0; thread < submitters; thread++) {
+		threads.emplace_back([&, thread]() {
+			auto begin = std::chrono::high_resolution_clock::now();
+			for (size_t idx = 0; idx < tasks / submitters; idx++) {
+				if (sticky) {
+					// Each submitter works on its own set of keys, like connections owned by a thread.
+					pool.push_sticky(thread * 16 + (idx % 16), task);
+				} else {
+					pool.push(task);
+				}
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			submit_time += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	size_t total = (tasks / submitters) * submitters;
+	while (done.load(std::memory_order_acquire) < total) {
+		std::this_thread::yield();
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	result res;
+	res.submit_ns = double(submit_time.load()) / double(total);
+	res.total_ms  = std::chrono::duration<double, std::milli>(end - start).count();
+	return res;
+}
+
+// Runs the same fine grained work one task at a time, in bulk, and through parallel_for.
+static void run_data_parallel(size_t items, size_t work)
+{
+	datapath::threadpool::pool pool;
+	std::vector<uint64_t>      values(items);
+
+	auto body = [&values, work](size_t idx) {
+		uint64_t value = idx;
+		for (size_t iter = 0; iter < work; iter++) {
+			value = value * 6364136223846793005ull + 1442695040888963407ull;
+		}
+		values[idx] = value;
+	};
+
+	printf("%zu items of %zu iterations\n", items, work);
+	printf("%-12s %12s\n", "Method", "Total ms");
+
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t idx = 0; idx < items; idx++) {
+			body(idx);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		printf("%-12s %12.2f\n", "Serial", std::chrono::duration<double, std::milli>(end - start).count());
+	}
+
+	{
+		std::atomic<size_t> done(0);
+		auto                start = std::chrono::high_resolution_clock::now();
+		for (size_t idx = 0; idx < items; idx++) {
+			pool.push([&body, &done, idx]() {
+				body(idx);
+				done.fetch_add(1, std::memory_order_release);
+			});
+		}
+		while (done.load(std::memory_order_acquire) < items) {
+			std::this_thread::yield();
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		printf("%-12s %12.2f\n", "Push", std::chrono::duration<double, std::milli>(end - start).count());
+	}
+
+	{
+		std::atomic<size_t>                                     done(0);
+		std::vector<std::shared_ptr<datapath::threadpool::task>> tasks(items);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t idx = 0; idx < items; idx++) {
+			tasks[idx]           = std::make_shared<datapath::threadpool::task>();
+			tasks[idx]->function = [&body, &done, idx]() {
+				body(idx);
+				done.fetch_add(1, std::memory_order_release);
+			};
+		}
+		pool.push_bulk(tasks);
+		while (done.load(std::memory_order_acquire) < items) {
+			std::this_thread::yield();
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		printf("%-12s %12.2f\n", "Bulk", std::chrono::duration<double, std::milli>(end - start).count());
+	}
+
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		pool.parallel_for(0, items, body);
+		auto end = std::chrono::high_resolution_clock::now();
+		printf("%-12s %12.2f\n", "ParallelFor", std::chrono::duration<double, std::milli>(end - start).count());
+	}
+}
+
+// Time from push() to the task starting, with pauses in between so that workers run out of work each time.
+static double run_latency(std::chrono::nanoseconds spin, size_t rounds)
+{
+	datapath::threadpool::options options;
+	options.spin = spin;
+	datapath::threadpool::pool pool(options);
+
+	double total = 0;
+	for (size_t round = 0; round < rounds; round++) {
+		std::atomic<int64_t> started(0);
+		auto                 pushed = std::chrono::high_resolution_clock::now();
+		pool.push([&started]() { started = std::chrono::high_resolution_clock::now().time_since_epoch().count(); });
+		while (started.load() == 0) {
+			std::this_thread::yield();
+		}
+		total += double(started.load() - pushed.time_since_epoch().count());
+
+		auto until = std::chrono::high_resolution_clock::now() + std::chrono::microseconds(20);
+		while (std::chrono::high_resolution_clock::now() < until) {
+		}
+	}
+	return total / double(rounds);
+}
+
+int main(int argc, const char* argv[])
+{
+	size_t tasks = 1000000;
+	size_t work  = 100;
+	if (argc > 1) {
+		tasks = strtoull(argv[1], nullptr, 10);
+	}
+	if (argc > 2) {
+		work = strtoull(argv[2], nullptr, 10);
+	}
+
+	struct {
+		const char*                  name;
+		datapath::threadpool::policy policy;
+		bool                         sticky;
+	} variants[] = {
+		{"LeastLoaded", datapath::threadpool::policy::LeastLoaded, false},
+		{"PowerOfTwo", datapath::threadpool::policy::PowerOfTwo, false},
+		{"Local", datapath::threadpool::policy::Local, false},
+		{"Sticky", datapath::threadpool::policy::PowerOfTwo, true},
+	};
+
+	printf("%zu tasks of %zu iterations from %zu threads\n", tasks, work, submitters);
+	printf("%-12s %14s %12s\n", "Policy", "Submit ns/task", "Total ms");
+	for (auto& variant : variants) {
+		result res = run(variant.policy, variant.sticky, tasks, work);
+		printf("%-12s %14.1f %12.2f\n", variant.name, res.submit_ns, res.total_ms);
+	}
+
+	printf("\n");
+	run_data_parallel(10000, work);
+
+	printf("\n%-12s %16s\n", "Idle", "Start ns/task");
+	printf("%-12s %16.1f\n", "Sleep", run_latency(std::chrono::nanoseconds(0), 10000));
+	printf("%-12s %16.1f\n", "Spin", run_latency(std::chrono::microseconds(50), 10000));
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "delta.hpp"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DELTA_SSE2
+#endif
+
+#define SIZE_ELEMENT uint32_t
+#define FRAME_HEADER_SIZE (sizeof(uint8_t) + sizeof(SIZE_ELEMENT))
+#define RUN_HEADER_SIZE (sizeof(SIZE_ELEMENT) + sizeof(SIZE_ELEMENT))
+
+// Unchanged gaps shorter than a run header are cheaper to encode as part of the run.
+#define MINIMUM_GAP RUN_HEADER_SIZE
+
+static inline void write_size(std::vector<char>& buffer, size_t offset, size_t value)
+{
+	SIZE_ELEMENT v = SIZE_ELEMENT(value);
+	std::memcpy(buffer.data() + offset, &v, sizeof(SIZE_ELEMENT));
+}
+
+static inline size_t read_size(const char* data)
+{
+	SIZE_ELEMENT v;
+	std::memcpy(&v, data, sizeof(SIZE_ELEMENT));
+	return v;
+}
+
+// Find the first byte in [pos, end) that differs between a and b.
+static size_t find_mismatch(const char* a, const char* b, size_t pos, size_t end)
+{
+#ifdef DELTA_SSE2
+	for (; (pos + sizeof(__m128i)) <= end; pos += sizeof(__m128i)) {
+		__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + pos));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + pos));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+			break;
+		}
+	}
+#else
+	for (; (pos + sizeof(uint64_t)) <= end; pos += sizeof(uint64_t)) {
+		uint64_t va, vb;
+		std::memcpy(&va, a + pos, sizeof(uint64_t));
+		std::memcpy(&vb, b + pos, sizeof(uint64_t));
+		if (va != vb) {
+			break;
+		}
+	}
+#endif
+	for (; pos < end; pos++) {
+		if (a[pos] != b[pos]) {
+			return pos;
+		}
+	}
+	return end;
+}
+
+// Find the end of a changed run starting at pos, which is the start of the next unchanged gap of MINIMUM_GAP bytes.
+static size_t find_run_end(const char* a, const char* b, size_t pos, size_t end)
+{
+	size_t equal = 0;
+	for (; pos < end; pos++) {
+		if (a[pos] == b[pos]) {
+			if (++equal >= MINIMUM_GAP) {
+				return pos + 1 - equal;
+			}
+		} else {
+			equal = 0;
+		}
+	}
+	return end - equal;
+}
+
+datapath::delta::encoder::encoder(size_t keyframe_interval)
+	: _keyframe_interval(keyframe_interval), _frames_since_keyframe(0), _force_keyframe(true)
+{}
+
+datapath::delta::encoder::~encoder() {}
+
+void datapath::delta::encoder::reset()
+{
+	_force_keyframe = true;
+}
+
+datapath::error datapath::delta::encoder::encode(const char* data, size_t length, std::vector<char>& output)
+{
+	if (length > std::numeric_limits<SIZE_ELEMENT>::max()) {
+		return datapath::error::NotSupported;
+	}
+
+	bool keyframe = _force_keyframe;
+	if ((_keyframe_interval > 0) && (_frames_since_keyframe >= _keyframe_interval)) {
+		keyframe = true;
+	}
+
+	output.resize(FRAME_HEADER_SIZE);
+	if (!keyframe) {
+		// Pad the previous message with zeros so that it covers the new one.
+		if (_last.size() < length) {
+			_last.resize(length, 0);
+		}
+
+		size_t pos = 0;
+		while (pos < length) {
+			size_t start = find_mismatch(data, _last.data(), pos, length);
+			if (start >= length) {
+				break;
+			}
+			size_t end = find_run_end(data, _last.data(), start, length);
+
+			size_t offset = output.size();
+			if ((offset + RUN_HEADER_SIZE + (end - start)) >= (FRAME_HEADER_SIZE + length)) {
+				// Delta is no longer smaller than a keyframe.
+				keyframe = true;
+				break;
+			}
+
+			output.resize(offset + RUN_HEADER_SIZE + (end - start));
+			write_size(output, offset, start - pos);
+			write_size(output, offset + sizeof(SIZE_ELEMENT), end - start);
+			char* run = output.data() + offset + RUN_HEADER_SIZE;
+			for (size_t idx = start; idx < end; idx++) {
+				*(run++) = data[idx] ^ _last[idx];
+			}
+
+			pos = end;
+		}
+	}
+
+	if (keyframe) {
+		output.resize(FRAME_HEADER_SIZE + length);
+		std::memcpy(output.data() + FRAME_HEADER_SIZE, data, length);
+		output[0]              = char(datapath::delta::frame::Keyframe);
+		_frames_since_keyframe = 0;
+		_force_keyframe        = false;
+	} else {
+		output[0] = char(datapath::delta::frame::Delta);
+		_frames_since_keyframe++;
+	}
+	write_size(output, sizeof(uint8_t), length);
+
+	_last.assign(data, data + length);
+	return datapath::error::Success;
+}
+
+datapath::delta::decoder::decoder(size_t max_size) : _has_keyframe(false), _max_size(max_size) {}
+
+datapath::delta::decoder::~decoder() {}
+
+void datapath::delta::decoder::reset()
+{
+	_has_keyframe = false;
+	_last.clear();
+}
+
+datapath::error datapath::delta::decoder::decode(const char* data, size_t length, std::vector<char>& output)
+{
+	if (length < FRAME_HEADER_SIZE) {
+		return datapath::error::Failure;
+	}
+
+	datapath::delta::frame type = datapath::delta::frame(data[0]);
+	size_t                 size = read_size(data + sizeof(uint8_t));
+	const char*            ptr  = data + FRAME_HEADER_SIZE;
+	const char*            end  = data + length;
+
+	// The size comes from the peer, check it before it decides how much memory is allocated.
+	if (size > _max_size) {
+		return datapath::error::Failure;
+	}
+
+	if (type == datapath::delta::frame::Keyframe) {
+		if (size_t(end - ptr) != size) {
+			return datapath::error::Failure;
+		}
+		_last.assign(ptr, end);
+		_has_keyframe = true;
+	} else if (type == datapath::delta::frame::Delta) {
+		if (!_has_keyframe) {
+			return datapath::error::Failure;
+		}
+
+		if (_last.size() < size) {
+			_last.resize(size, 0);
+		}
+
+		size_t pos = 0;
+		while (ptr < end) {
+			if (size_t(end - ptr) < RUN_HEADER_SIZE) {
+				reset();
+				return datapath::error::Failure;
+			}
+			size_t skip  = read_size(ptr);
+			size_t count = read_size(ptr + sizeof(SIZE_ELEMENT));
+			ptr += RUN_HEADER_SIZE;
+
+			pos += skip;
+			if ((count > size_t(end - ptr)) || (pos > size) || (count > (size - pos))) {
+				reset();
+				return datapath::error::Failure;
+			}
+
+			for (size_t idx = 0; idx < count; idx++) {
+				_last[pos++] ^= *(ptr++);
+			}
+		}
+		_last.resize(size);
+	} else {
+		return datapath::error::Failure;
+	}
+
+	if (&output != &_last) {
+		output.assign(_last.begin(), _last.end());
+	}
+	return datapath::error::Success;
+}
+
+datapath::error datapath::delta::decoder::push(const std::vector<char>& data)
+{
+	datapath::error ec = decode(data.data(), data.size(), _last);
+	if ((ec == datapath::error::Success) && this->on_message) {
+		this->on_message(_last);
+	}
+	return ec;
+}
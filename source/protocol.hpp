@@ -0,0 +1,46 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cinttypes>
+
+// Every frame starts with its length.
+#define SIZE_ELEMENT uint32_t
+
+// Frames with this bit set in the length are consumed by the library and never reach on_message.
+#define CONTROL_FLAG SIZE_ELEMENT(0x80000000ul)
+
+namespace datapath {
+	namespace protocol {
+		enum class control : uint8_t {
+			// Receiver grants the sender more bytes and messages.
+			Credit,
+		};
+
+#pragma pack(push, 1)
+		struct credit {
+			control  type;
+			uint32_t bytes;
+			uint32_t messages;
+		};
+#pragma pack(pop)
+
+		// Sent as a credit grant to turn flow control off again.
+		constexpr uint32_t credit_unlimited = 0xFFFFFFFFul;
+	} // namespace protocol
+} // namespace datapath
@@ -0,0 +1,113 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "router.hpp"
+#include <cstring>
+#include <stdexcept>
+
+datapath::router::state::state(size_t types) : handlers(types) {}
+
+void datapath::router::state::route(const char* data, size_t size)
+{
+	datapath::message_view msg{data, size};
+
+	type_t type  = 0;
+	bool   typed = false;
+	if (extractor) {
+		typed = extractor(data, size, type);
+	} else if (size >= sizeof(type_t)) {
+		std::memcpy(&type, data, sizeof(type_t));
+		typed = true;
+	}
+
+	if (typed && (type < handlers.size()) && handlers[type]) {
+		handlers[type](msg);
+	} else if (on_unhandled) {
+		on_unhandled(msg);
+	}
+}
+
+datapath::router::router(size_t types) : _state(std::make_shared<state>(types)), on_unhandled(_state->on_unhandled)
+{}
+
+datapath::router::~router()
+{
+	std::unique_lock<std::mutex> ul(_lock);
+	for (auto& kv : _sockets) {
+		if (auto socket = kv.first.lock()) {
+			socket->on_message.remove(kv.second);
+		}
+	}
+	_sockets.clear();
+}
+
+void datapath::router::set_extractor(extractor_t extractor)
+{
+	_state->extractor = extractor;
+}
+
+datapath::router::token_t datapath::router::add(type_t type, handlers_t::function_t handler)
+{
+	if (type >= _state->handlers.size()) {
+		throw std::out_of_range("type is outside of the routing table");
+	}
+	return _state->handlers[type].add(handler);
+}
+
+void datapath::router::remove(type_t type, token_t token)
+{
+	if (type < _state->handlers.size()) {
+		_state->handlers[type].remove(token);
+	}
+}
+
+void datapath::router::route(const char* data, size_t size)
+{
+	_state->route(data, size);
+}
+
+void datapath::router::attach(std::shared_ptr<datapath::isocket> socket)
+{
+	// Only hold a weak reference, a call that is already in flight may outlive the router.
+	std::weak_ptr<state> weak = _state;
+
+	token_t token = socket->on_message.add([weak](const std::vector<char>& data) {
+		if (auto obj = weak.lock()) {
+			obj->route(data.data(), data.size());
+		}
+	});
+
+	std::unique_lock<std::mutex> ul(_lock);
+	_sockets.emplace_back(socket, token);
+}
+
+void datapath::router::detach(std::shared_ptr<datapath::isocket> socket)
+{
+	std::unique_lock<std::mutex> ul(_lock);
+	for (auto itr = _sockets.begin(); itr != _sockets.end();) {
+		auto obj = itr->first.lock();
+		if (!obj || (obj == socket)) {
+			if (obj) {
+				obj->on_message.remove(itr->second);
+			}
+			itr = _sockets.erase(itr);
+		} else {
+			itr++;
+		}
+	}
+}
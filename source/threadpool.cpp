@@ -16,92 +16,822 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
  */
-
 #include "threadpool.hpp"
-#ifdef _WIN32
-#include <windows.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include "work-deque.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Job slots are a cache line each, so that workers never share one.
+#define JOB_SLOT_SIZE 64
+
+// Job slots are allocated this many at a time, and move between threads in batches of this size.
+#define JOB_SLOT_BATCH 64
+
+// Free job slots a thread keeps for itself before handing them back.
+#define JOB_SLOT_CACHE (JOB_SLOT_BATCH * 4)
+
+// Normal priority tasks get a turn after this many high priority tasks in a row.
+#define PRIORITY_STREAK_MAX 16
+
+// Chunks per worker for parallel_for and parallel_reduce without a grain size.
+#define PARALLEL_CHUNKS_PER_WORKER 4
+
+// Pause instructions between two looks for work while spinning.
+#define SPIN_PAUSES 32
+
+namespace {
+	static inline void cpu_pause()
+	{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#else
+		std::this_thread::yield();
 #endif
+	}
+
+	static inline uint32_t next_random()
+	{
+		static thread_local uint32_t state = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// Free job slots shared by all threads.
+	class job_slots {
+		std::mutex                           _lock;
+		std::vector<void*>                   _free;
+		std::vector<std::unique_ptr<char[]>> _blocks;
+
+		public:
+		void take(std::vector<void*>& slots)
+		{
+			std::unique_lock<std::mutex> lock(_lock);
+			if (_free.size() < JOB_SLOT_BATCH) {
+				std::unique_ptr<char[]> block(new char[JOB_SLOT_SIZE * (JOB_SLOT_BATCH + 1)]);
+				char*                   ptr = reinterpret_cast<char*>(
+					(reinterpret_cast<uintptr_t>(block.get()) + (JOB_SLOT_SIZE - 1)) & ~uintptr_t(JOB_SLOT_SIZE - 1));
+				for (size_t idx = 0; idx < JOB_SLOT_BATCH; idx++) {
+					_free.push_back(ptr + (idx * JOB_SLOT_SIZE));
+				}
+				_blocks.push_back(std::move(block));
+			}
+			slots.insert(slots.end(), _free.end() - JOB_SLOT_BATCH, _free.end());
+			_free.resize(_free.size() - JOB_SLOT_BATCH);
+		}
+
+		void give(std::vector<void*>& slots, size_t count)
+		{
+			std::unique_lock<std::mutex> lock(_lock);
+			_free.insert(_free.end(), slots.end() - count, slots.end());
+			slots.resize(slots.size() - count);
+		}
+
+		static job_slots& instance()
+		{
+			// Never destroyed, threads that outlive main, such as a reactor that stopped itself, still hand slots back.
+			static job_slots* slots = new job_slots();
+			return *slots;
+		}
+	};
+
+	// Free job slots of the current thread, handed back when the thread exits.
+	struct job_cache {
+		std::vector<void*> slots;
+
+		job_cache()
+		{
+			slots.reserve(JOB_SLOT_CACHE + JOB_SLOT_BATCH);
+		}
+
+		~job_cache()
+		{
+			job_slots::instance().give(slots, slots.size());
+		}
+	};
+
+	thread_local job_cache cache;
+
+	// Shared by everyone working on a parallel_for or parallel_reduce, helpers may start after it is done.
+	struct parallel_state {
+		const std::function<void(size_t, size_t, size_t)>* body;
+		size_t                                             count;
+		size_t                                             size;
+		size_t                                             chunks;
+		std::atomic<size_t>                                next;
+		std::atomic<size_t>                                finished;
+		std::mutex                                         lock;
+		std::condition_variable                            signal;
+
+		// First exception thrown by the body, rethrown on the calling thread once everyone is done with the body.
+		std::exception_ptr error;
+	};
+
+	static void parallel_work(parallel_state& state)
+	{
+		size_t finished = 0;
+		for (size_t chunk = state.next++; chunk < state.chunks; chunk = state.next++) {
+			size_t first = chunk * state.size;
+			try {
+				(*state.body)(chunk, first, std::min(first + state.size, state.count));
+			} catch (...) {
+				std::unique_lock<std::mutex> lock(state.lock);
+				if (!state.error) {
+					state.error = std::current_exception();
+				}
+
+				// Chunks nobody took yet are skipped, and count as finished.
+				size_t next = state.next.exchange(state.chunks);
+				if (next < state.chunks) {
+					finished += state.chunks - next;
+				}
+			}
+			finished++;
+		}
+
+		if ((finished > 0) && ((state.finished += finished) == state.chunks)) {
+			std::unique_lock<std::mutex> lock(state.lock);
+			state.signal.notify_all();
+		}
+	}
+} // namespace
+
+struct datapath::threadpool::handle::node {
+	datapath::threadpool::pool*        parent;
+	std::function<void()>              function;
+	datapath::threadpool::affinity_t   mask;
+	std::atomic<size_t>                pending;
+	std::atomic<bool>                  done;
+	std::mutex                         lock;
+	std::condition_variable            signal;
+	std::vector<std::shared_ptr<node>> successors;
+};
+
+struct datapath::threadpool::pool::worker {
+	datapath::threadpool::pool*  parent;
+	size_t                       index;
+	datapath::threadpool::cpuset processors;
+	size_t                       node;
+	std::atomic<bool>            should_stop;
+	std::thread                  thread;
+
+	// Tasks pushed by this worker, stolen by other workers from the other end.
+	datapath::threadpool::work_deque<job> local;
+
+	struct queue {
+		std::mutex          lock;
+		std::deque<job*>    queue;
+		std::atomic<size_t> size;
+		std::atomic<size_t> stealable;
+
+		// Kept as a heap with the earliest deadline at the front, otherwise in the order pushed.
+		bool ordered = false;
+	};
+
+	// Tasks pushed from outside the pool, and tasks that may only run on this worker.
+	queue inbox;
+
+	// High priority tasks and tasks with a deadline, as a heap with the earliest deadline at the front.
+	queue urgent;
+
+	// Low priority tasks, oldest first.
+	queue background;
 
-datapath::threadpool::pool::worker::worker(affinity_t affinity) : affinity(affinity), should_stop(false)
+	// High priority tasks run in a row.
+	size_t streak;
+
+	struct {
+		std::mutex              lock;
+		std::condition_variable signal;
+		std::atomic<bool>       sleeping;
+		bool                    wake = false;
+
+		// Woken by _wake_one(), which holds the waking token until we are searching.
+		bool token = false;
+	} idle;
+
+	// Counted in the pools searching workers.
+	bool searching;
+
+	// Has a thread, which stops after being idle for a while.
+	std::atomic<bool> running;
+
+	uint32_t random;
+
+	worker(datapath::threadpool::pool* parent, size_t index, datapath::threadpool::cpuset processors, size_t node);
+	~worker();
+
+	void start();
+
+	void stop();
+
+	void runner();
+
+	job* find_work();
+
+	bool has_work();
+
+	job* spin();
+
+	void stop_searching(bool found);
+
+	bool sleep();
+
+	bool retire();
+
+	bool wake(bool token = false);
+
+	void clear();
+
+	void push(job* job);
+
+	void push(job** jobs, size_t count);
+
+	static inline bool later(const job* left, const job* right)
+	{
+		return left->deadline > right->deadline;
+	}
+
+	static void put(queue& queue, job** jobs, size_t count);
+
+	static job* take(queue& queue, bool steal,
+					 datapath::threadpool::deadline_t due = datapath::threadpool::no_deadline);
+
+	inline size_t size() const
+	{
+		return this->inbox.size.load(std::memory_order_relaxed) + this->urgent.size.load(std::memory_order_relaxed)
+			   + this->local.size();
+	}
+};
+
+datapath::threadpool::pool::worker::worker(datapath::threadpool::pool* parent, size_t index,
+										   datapath::threadpool::cpuset processors, size_t node)
+	: parent(parent), index(index), processors(processors), node(node), should_stop(false), streak(0), searching(false),
+	  running(false), random(uint32_t((index + 1) * 2654435761ull) | 1)
 {
-	std::unique_lock<std::mutex> qlock(this->mutex);
-	this->thread = std::thread(&datapath::threadpool::pool::worker::runner, this);
+	for (queue* obj : {&this->inbox, &this->urgent, &this->background}) {
+		obj->size      = 0;
+		obj->stealable = 0;
+	}
+	this->urgent.ordered = true;
+	this->idle.sleeping  = false;
 }
 
 datapath::threadpool::pool::worker::~worker()
 {
-	this->should_stop = true;
-	this->signal.notify_all();
+	stop();
 	if (this->thread.joinable()) {
 		this->thread.join();
 	}
+	clear();
+}
+
+void datapath::threadpool::pool::worker::start()
+{
+	std::thread previous;
+	{
+		std::unique_lock<std::mutex> lock(this->idle.lock);
+		if (this->running || this->should_stop) {
+			return;
+		}
+		this->running = true;
+		previous      = std::move(this->thread);
+		this->thread  = std::thread(&datapath::threadpool::pool::worker::runner, this);
+	}
+
+	// A retired thread only has to return from runner().
+	if (previous.joinable()) {
+		previous.join();
+	}
+}
+
+void datapath::threadpool::pool::worker::stop()
+{
+	this->should_stop = true;
+	std::unique_lock<std::mutex> lock(this->idle.lock);
+	this->idle.wake = true;
+	this->idle.signal.notify_all();
 }
 
 void datapath::threadpool::pool::worker::runner()
 {
-	std::shared_ptr<datapath::threadpool::task> my_task;
+	_current() = this;
 
-	// Assign affinity
-#ifdef _WIN32
-	SetThreadAffinityMask(reinterpret_cast<HANDLE>(this->thread.native_handle()), this->affinity);
-#else
-#endif
+	// Assign affinity, this->thread may not be assigned yet.
+	datapath::threadpool::topology::pin(this->processors);
 
 	while (!this->should_stop) {
-		{ // Grab any available work.
-			std::unique_lock<std::mutex> lock(this->mutex);
-			if (this->queue.size() > 0)
-				my_task = this->queue.front();
+		job* my_job = find_work();
+		if (!my_job) {
+			my_job = spin();
+		} else if (this->searching) {
+			stop_searching(true);
+		}
+		if (!my_job) {
+			if (!sleep()) {
+				// Retired, the worker may already run on a new thread.
+				_current() = nullptr;
+				return;
+			}
+			continue;
 		}
 
-		if (my_task) // Execute work if we have any.
-			if (my_task->function)
-				my_task->function();
+		// More work is waiting behind this job, other workers may be needed for it.
+		size_t pending = size();
+		if (pending > 0) {
+			this->parent->_check_backlog(pending);
+		}
+
+		my_job->invoke(my_job);
+		my_job->destroy(my_job);
+		_release(my_job);
+	}
+
+	if (this->searching) {
+		stop_searching(false);
+	}
+	_current() = nullptr;
+}
+
+datapath::threadpool::pool::job* datapath::threadpool::pool::worker::find_work()
+{
+	// Earliest deadline first, but let normal work through every now and then.
+	if ((this->urgent.size > 0) && (this->streak < PRIORITY_STREAK_MAX)) {
+		if (job* my_job = take(this->urgent, false)) {
+			this->streak++;
+			return my_job;
+		}
+	}
+	this->streak = 0;
+
+	// Low priority work that has waited long enough.
+	if (this->background.size > 0) {
+		if (job* my_job = take(this->background, false, std::chrono::steady_clock::now())) {
+			return my_job;
+		}
+	}
+
+	// Newest local work first, it is most likely still in cache.
+	if (job* my_job = this->local.pop()) {
+		return my_job;
+	}
+
+	if (this->inbox.size > 0) {
+		if (job* my_job = take(this->inbox, false)) {
+			return my_job;
+		}
+	}
 
-		{ // Remove it from the queue and wait.
-			std::unique_lock<std::mutex> slock(this->mutex);
-			if (my_task) {
-				this->queue.pop();
-				my_task.reset();
+	// Steal from the other workers, starting at a random one. Node local pools look at their own node first. Urgent
+	// work is looked for across all workers before anything else.
+	auto&  workers = this->parent->_workers;
+	size_t count   = workers.size();
+	bool   local   = this->parent->_options.node_local;
+	this->random ^= this->random << 13;
+	this->random ^= this->random >> 17;
+	this->random ^= this->random << 5;
+	size_t start = this->random % count;
+	for (size_t pass = 0; pass < 2; pass++) {
+		for (size_t idx = 0; idx < (local ? count * 2 : count); idx++) {
+			worker* victim = workers[(start + idx) % count].get();
+			if ((victim == this) || (local && ((victim->node == this->node) != (idx < count)))) {
+				continue;
 			}
-			if (this->queue.size() == 0) {
-				this->signal.wait(slock, [this]() { return (this->should_stop) || (this->queue.size() > 0); });
+
+			if (pass == 0) {
+				if (victim->urgent.stealable > 0) {
+					if (job* my_job = take(victim->urgent, true)) {
+						return my_job;
+					}
+				}
+				continue;
+			}
+
+			if (job* my_job = victim->local.steal()) {
+				return my_job;
+			}
+
+			if (victim->inbox.stealable > 0) {
+				if (job* my_job = take(victim->inbox, true)) {
+					return my_job;
+				}
 			}
 		}
 	}
+
+	// Nothing else to do.
+	if (this->urgent.size > 0) {
+		if (job* my_job = take(this->urgent, false)) {
+			return my_job;
+		}
+	}
+	if (this->background.size > 0) {
+		if (job* my_job = take(this->background, false)) {
+			return my_job;
+		}
+	}
+	for (size_t idx = 0; idx < count; idx++) {
+		worker* victim = workers[(start + idx) % count].get();
+		if ((victim != this) && (victim->background.stealable > 0)) {
+			if (job* my_job = take(victim->background, true)) {
+				return my_job;
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+bool datapath::threadpool::pool::worker::has_work()
+{
+	if ((this->inbox.size > 0) || (this->urgent.size > 0) || (this->background.size > 0)) {
+		return true;
+	}
+	for (auto& other : this->parent->_workers) {
+		if (!other->local.empty() || (other->inbox.stealable > 0) || (other->urgent.stealable > 0)
+			|| (other->background.stealable > 0)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+datapath::threadpool::pool::job* datapath::threadpool::pool::worker::spin()
+{
+	// While anyone is searching, pushes do not wake sleeping workers.
+	if (!this->searching) {
+		this->searching = true;
+		this->parent->_searching++;
+	}
+
+	// Work usually shows up again soon, which is far cheaper to notice here than after going to sleep.
+	job* my_job   = nullptr;
+	auto deadline = std::chrono::steady_clock::now() + this->parent->_options.spin;
+	do {
+		if (has_work()) {
+			my_job = find_work();
+		}
+		if (!my_job) {
+			for (size_t idx = 0; idx < SPIN_PAUSES; idx++) {
+				cpu_pause();
+			}
+		}
+	} while (!my_job && !this->should_stop && (std::chrono::steady_clock::now() < deadline));
+
+	stop_searching(my_job != nullptr);
+	return my_job;
+}
+
+void datapath::threadpool::pool::worker::stop_searching(bool found)
+{
+	this->searching = false;
+
+	// The last searcher to find work hands the search on, there may be more where it came from.
+	if ((--this->parent->_searching == 0) && found && has_work()) {
+		this->parent->_wake_one();
+	}
+}
+
+bool datapath::threadpool::pool::worker::sleep()
+{
+	std::unique_lock<std::mutex> lock(this->idle.lock);
+	this->idle.sleeping = true;
+	this->parent->_sleeping++;
+
+	// Anything pushed after this point sees us sleeping and wakes us up, anything before is found here.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	bool retired = false;
+	if (!has_work()) {
+		auto timeout = this->parent->_options.idle_timeout;
+		auto woken   = [this]() { return this->should_stop || this->idle.wake; };
+		if (timeout.count() == 0) {
+			this->idle.signal.wait(lock, woken);
+		} else {
+			while (!this->idle.signal.wait_for(lock, timeout, woken)) {
+				if (retire()) {
+					retired = true;
+					break;
+				}
+			}
+		}
+	}
+
+	this->idle.wake     = false;
+	this->idle.sleeping = false;
+	this->parent->_sleeping--;
+	if (retired) {
+		return false;
+	}
+
+	// Count as searching before handing the token back, so that pushes in between do not wake anyone else.
+	this->searching = true;
+	this->parent->_searching++;
+	if (this->idle.token) {
+		this->idle.token       = false;
+		this->parent->_waking = false;
+	}
+	return true;
+}
+
+bool datapath::threadpool::pool::worker::retire()
+{
+	// Called with the idle lock held, so anything pushed to us from here on sees us stopped and starts us again.
+	if ((this->inbox.size > 0) || (this->urgent.size > 0) || (this->background.size > 0) || !this->local.empty()) {
+		return false;
+	}
+
+	// Running workers are the first ones in the pool, so only the last of them may go. Workers behind them only ran
+	// for tasks pushed to them directly.
+	size_t active = this->parent->_active;
+	if (this->index < active) {
+		if (((this->index + 1) != active) || (active <= this->parent->_options.min_workers)
+			|| !this->parent->_active.compare_exchange_strong(active, active - 1)) {
+			return false;
+		}
+	}
+
+	this->running = false;
+	return true;
+}
+
+bool datapath::threadpool::pool::worker::wake(bool token)
+{
+	if (this->idle.sleeping) {
+		std::unique_lock<std::mutex> lock(this->idle.lock);
+		if (this->running && this->idle.sleeping && !this->idle.wake) {
+			this->idle.wake  = true;
+			this->idle.token = token;
+			this->idle.signal.notify_one();
+			return true;
+		}
+	}
+
+	// Retiring workers stop running before they stop sleeping, so one missed above is seen stopped here.
+	if (!this->running) {
+		// A new thread looks for work on its own, it does not need the waking token.
+		if (token) {
+			this->parent->_waking = false;
+		}
+		start();
+		return true;
+	}
+	return false;
 }
 
 void datapath::threadpool::pool::worker::clear()
 {
-	std::unique_lock<std::mutex> slock(this->mutex);
-	while (this->queue.size() > 0)
-		this->queue.pop();
+	for (queue* obj : {&this->inbox, &this->urgent, &this->background}) {
+		std::unique_lock<std::mutex> lock(obj->lock);
+		for (job* my_job : obj->queue) {
+			my_job->destroy(my_job);
+			_release(my_job);
+		}
+		obj->queue.clear();
+		obj->size      = 0;
+		obj->stealable = 0;
+	}
+	while (job* my_job = this->local.steal()) {
+		my_job->destroy(my_job);
+		_release(my_job);
+	}
 }
 
-void datapath::threadpool::pool::worker::push(std::shared_ptr<task> task)
+void datapath::threadpool::pool::worker::push(job* job)
 {
-	{
-		std::unique_lock<std::mutex> slock(this->mutex);
-		this->queue.push(task);
+	if (job->priority == datapath::threadpool::priority::High) {
+		put(this->urgent, &job, 1);
+	} else if (job->priority == datapath::threadpool::priority::Low) {
+		put(this->background, &job, 1);
+	} else {
+		put(this->inbox, &job, 1);
 	}
-	this->signal.notify_all();
 }
 
-datapath::threadpool::pool::pool()
+void datapath::threadpool::pool::worker::push(job** jobs, size_t count)
 {
-	// Spawn x number of threads for working.
-	uint64_t num_hw_concurrency = std::thread::hardware_concurrency();
-	for (uint64_t idx = 0; idx < num_hw_concurrency; idx++) {
-		auto worker = std::make_shared<datapath::threadpool::pool::worker>(1 << idx);
-		this->_workers.insert({idx, worker});
+	// Sort by queue first, jobs may already run and be reused once they are in one.
+	job** end    = jobs + count;
+	job** urgent = std::stable_partition(
+		jobs, end, [](job* obj) { return obj->priority == datapath::threadpool::priority::Normal; });
+	job** background = std::stable_partition(
+		urgent, end, [](job* obj) { return obj->priority == datapath::threadpool::priority::High; });
+
+	put(this->inbox, jobs, size_t(urgent - jobs));
+	put(this->urgent, urgent, size_t(background - urgent));
+	put(this->background, background, size_t(end - background));
+	wake();
+}
+
+void datapath::threadpool::pool::worker::put(queue& queue, job** jobs, size_t count)
+{
+	if (count == 0) {
+		return;
 	}
+
+	std::unique_lock<std::mutex> lock(queue.lock);
+	for (size_t idx = 0; idx < count; idx++) {
+		queue.queue.push_back(jobs[idx]);
+		if (queue.ordered) {
+			std::push_heap(queue.queue.begin(), queue.queue.end(), &later);
+		}
+		if (jobs[idx]->stealable) {
+			queue.stealable++;
+		}
+		queue.size++;
+	}
+}
+
+datapath::threadpool::pool::job* datapath::threadpool::pool::worker::take(queue& queue, bool steal,
+																		   datapath::threadpool::deadline_t due)
+{
+	// Thieves only take what may run anywhere, and do not wait for the lock.
+	std::unique_lock<std::mutex> lock(queue.lock, std::defer_lock);
+	if (steal) {
+		if (!lock.try_lock()) {
+			return nullptr;
+		}
+	} else {
+		lock.lock();
+	}
+
+	if (queue.queue.empty() || (steal && !queue.queue.front()->stealable) || (queue.queue.front()->deadline > due)) {
+		return nullptr;
+	}
+
+	job* my_job = queue.queue.front();
+	if (queue.ordered) {
+		std::pop_heap(queue.queue.begin(), queue.queue.end(), &later);
+		queue.queue.pop_back();
+	} else {
+		queue.queue.pop_front();
+	}
+	queue.size--;
+	if (my_job->stealable) {
+		queue.stealable--;
+	}
+	return my_job;
+}
+
+datapath::threadpool::pool::pool(const datapath::threadpool::options& options)
+	: _options(options), _sleeping(0), _searching(0), _waking(false), _active(0), _backlog(0), _next(0)
+{
+	const datapath::threadpool::topology& topology = datapath::threadpool::topology::instance();
+
+	// Group the logical processors by what each worker is pinned to.
+	std::vector<std::pair<size_t, datapath::threadpool::cpuset>> groups;
+	if (options.placement == datapath::threadpool::placement::PhysicalCore) {
+		groups.resize(topology.cores());
+		for (auto& proc : topology.processors()) {
+			groups[proc.core].first = proc.node;
+			groups[proc.core].second.set(proc.id);
+		}
+	} else if (options.placement == datapath::threadpool::placement::Node) {
+		std::vector<datapath::threadpool::cpuset> nodes(topology.nodes());
+		for (auto& proc : topology.processors()) {
+			nodes[proc.node].set(proc.id);
+		}
+		for (auto& proc : topology.processors()) {
+			groups.push_back({proc.node, nodes[proc.node]});
+		}
+	} else {
+		for (auto& proc : topology.processors()) {
+			groups.push_back({proc.node, datapath::threadpool::cpuset::of(proc.id)});
+		}
+	}
+
+	groups.erase(std::remove_if(groups.begin(), groups.end(),
+								[](const std::pair<size_t, datapath::threadpool::cpuset>& group) {
+									return group.second.empty();
+								}),
+				 groups.end());
+
+	// Spread a limited number of workers evenly across the machine.
+	size_t workers = groups.size();
+	if ((options.max_workers > 0) && (options.max_workers < workers)) {
+		workers = options.max_workers;
+	}
+
+	// Threads are only started when needed, creating the workers themselves is cheap.
+	for (size_t idx = 0; idx < workers; idx++) {
+		auto& group  = groups[idx * groups.size() / workers];
+		auto  worker = std::make_shared<datapath::threadpool::pool::worker>(this, this->_workers.size(),
+																			group.second, group.first);
+		this->_workers.push_back(worker);
+		this->_everyone.push_back(worker.get());
+		if (worker->node >= this->_nodes.size()) {
+			this->_nodes.resize(worker->node + 1);
+		}
+		this->_nodes[worker->node].push_back(worker.get());
+	}
+
+	// Workers look at each other, so only start them once all exist.
+	_grow(options.min_workers);
 }
 
 datapath::threadpool::pool::~pool()
 {
+	// Stop everything first, workers may still be stealing from each other. Stopped workers are never started again.
+	for (auto& worker : this->_workers) {
+		worker->stop();
+	}
+	for (auto& worker : this->_workers) {
+		std::thread thread;
+		{
+			std::unique_lock<std::mutex> lock(worker->idle.lock);
+			thread = std::move(worker->thread);
+		}
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
 	this->_workers.clear();
 }
 
+void datapath::threadpool::pool::_grow(size_t count)
+{
+	count = std::min(count, this->_everyone.size());
+	for (size_t active = this->_active; active < count; active = this->_active) {
+		if (this->_active.compare_exchange_weak(active, active + 1)) {
+			this->_everyone[active]->start();
+		}
+	}
+}
+
+void datapath::threadpool::pool::_check_backlog(size_t pending)
+{
+	// Work is piling up while every running worker is busy, add workers for it once that went on for long enough.
+	if ((this->_sleeping > 0) || (this->_searching > 0) || (this->_active >= this->_everyone.size())) {
+		if (this->_backlog != 0) {
+			this->_backlog = 0;
+		}
+		return;
+	}
+
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					  std::chrono::steady_clock::now().time_since_epoch())
+					  .count();
+	int64_t since = this->_backlog;
+	if (since == 0) {
+		this->_backlog.compare_exchange_strong(since, now);
+	} else if (((now - since) >= this->_options.grow_latency.count())
+			   && this->_backlog.compare_exchange_strong(since, 0)) {
+		_grow(this->_active + pending);
+	}
+}
+
+datapath::threadpool::pool::worker*& datapath::threadpool::pool::_current()
+{
+	// Worker running on the current thread, if any.
+	static thread_local worker* current = nullptr;
+	return current;
+}
+
+datapath::threadpool::pool::job* datapath::threadpool::pool::_acquire()
+{
+	static_assert(sizeof(job) <= JOB_SLOT_SIZE, "job does not fit into a slot");
+
+	if (cache.slots.empty()) {
+		job_slots::instance().take(cache.slots);
+	}
+	void* slot = cache.slots.back();
+	cache.slots.pop_back();
+	return new (slot) job;
+}
+
+void datapath::threadpool::pool::_release(job* job)
+{
+	// Jobs are usually released on a different thread than they were acquired on, so slots drift between threads.
+	cache.slots.push_back(job);
+	if (cache.slots.size() > JOB_SLOT_CACHE) {
+		job_slots::instance().give(cache.slots, JOB_SLOT_BATCH);
+	}
+}
+
+void datapath::threadpool::pool::_wake_one()
+{
+	// Searching workers find new work on their own, and only one sleeping worker is woken at a time. It wakes the
+	// next one once it found something.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if ((this->_searching > 0) || this->_waking.exchange(true)) {
+		return;
+	}
+
+	for (auto& worker : this->_workers) {
+		if (worker->idle.sleeping && worker->wake(true)) {
+			return;
+		}
+	}
+	this->_waking = false;
+}
+
 bool datapath::threadpool::pool::push(std::shared_ptr<task> task)
 {
 	// Early-Exit tests.
@@ -112,44 +842,390 @@ bool datapath::threadpool::pool::push(std::shared_ptr<task> task)
 	if (!task->function) {
 		throw std::invalid_argument("task->function must not be nullptr");
 	}
-	/// Check for invalid affinity masks.
-	if ((task->mask & (this->_workers.size() - 1)) == 0) {
-		throw std::invalid_argument("mask does not fit any thread");
+
+	return push([task]() { task->function(); }, task->priority, task->deadline, task->mask);
+}
+
+bool datapath::threadpool::pool::_submit(job* my_job, const affinity_t& mask, bool sticky, size_t key)
+{
+	// Workers that may run the task, preferring the node of the caller. Sticky keys ignore the node, as they would
+	// otherwise map to a different worker depending on where the caller runs.
+	const std::vector<worker*>* candidates = &this->_everyone;
+	if (!sticky && this->_options.node_local && (this->_nodes.size() > 1)) {
+		size_t node = datapath::threadpool::topology::instance().current_node();
+		if ((node < this->_nodes.size()) && !this->_nodes[node].empty()) {
+			candidates = &this->_nodes[node];
+		}
 	}
 
-	affinity_t lowest_id;
-	size_t     lowest_count = std::numeric_limits<size_t>::max();
-	for (auto kv : _workers) {
-		if ((kv.second->affinity & task->mask) == 0) {
-			continue;
+	// Only tasks that may run anywhere can be stolen.
+	my_job->stealable = mask.is_all();
+	if (!my_job->stealable) {
+		static thread_local std::vector<worker*> matching;
+		matching.clear();
+		size_t matches = 0;
+		for (worker* obj : this->_everyone) {
+			if (mask.test(obj->index)) {
+				matches++;
+				if (std::find(candidates->begin(), candidates->end(), obj) != candidates->end()) {
+					matching.push_back(obj);
+				}
+			}
+		}
+		if (matches == 0) {
+			my_job->destroy(my_job);
+			_release(my_job);
+			throw std::invalid_argument("mask does not fit any thread");
+		}
+		if (matching.empty()) {
+			for (worker* obj : this->_everyone) {
+				if (mask.test(obj->index)) {
+					matching.push_back(obj);
+				}
+			}
 		}
+		my_job->stealable = (matches == this->_everyone.size());
+		candidates        = &matching;
+	}
+
+	_prioritize(my_job);
 
-		std::unique_lock<std::mutex> lock(kv.second->mutex);
-		if (kv.second->queue.size() < lowest_count) {
-			lowest_id    = kv.first;
-			lowest_count = kv.second->queue.size();
+	// Workers keep their own work, idle workers steal it if they get to it first.
+	worker* self = _current();
+	if (!sticky && self && (self->parent == this) && my_job->stealable
+		&& (my_job->priority == datapath::threadpool::priority::Normal)) {
+		self->local.push(my_job);
+		if (this->_sleeping > 0) {
+			_wake_one();
 		}
+		_check_backlog();
+		return true;
 	}
-	if (lowest_count == std::numeric_limits<size_t>::max()) {
-		return false;
+
+	// Tasks that may run anywhere go to running workers, which are the first ones in the pool.
+	size_t count = candidates->size();
+	if (!sticky && mask.is_all()) {
+		if (this->_active == 0) {
+			_grow(1);
+		}
+		size_t active = std::max<size_t>(this->_active, 1);
+		if (candidates != &this->_everyone) {
+			count = size_t(std::partition_point(candidates->begin(), candidates->end(),
+												[active](worker* obj) { return obj->index < active; })
+						   - candidates->begin());
+			if (count == 0) {
+				candidates = &this->_everyone;
+			}
+		}
+		if (candidates == &this->_everyone) {
+			count = std::min(active, candidates->size());
+		}
+	}
+
+	worker* target = nullptr;
+	if (sticky) {
+		target            = (*candidates)[size_t((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> 32) % count];
+		my_job->stealable = false;
+	} else if (this->_options.policy == datapath::threadpool::policy::PowerOfTwo) {
+		worker* first  = (*candidates)[next_random() % count];
+		worker* second = (*candidates)[next_random() % count];
+		target         = (first->size() <= second->size()) ? first : second;
+	} else if (this->_options.policy == datapath::threadpool::policy::Local) {
+		if (self && (self->parent == this) && mask.test(self->index)) {
+			target = self;
+		} else {
+			// Remember a worker per thread, handed out in turns.
+			static thread_local pool*  owner = nullptr;
+			static thread_local size_t slot  = 0;
+			if (owner != this) {
+				owner = this;
+				slot  = this->_next++;
+			}
+			target = (*candidates)[slot % count];
+		}
+	} else {
+		// Approximate sizes are good enough, and need no locks.
+		size_t lowest_count = std::numeric_limits<size_t>::max();
+		for (size_t idx = 0; idx < count; idx++) {
+			size_t size = (*candidates)[idx]->size();
+			if (size < lowest_count) {
+				target       = (*candidates)[idx];
+				lowest_count = size;
+			}
+		}
+	}
+
+	bool stealable = my_job->stealable;
+	target->push(my_job);
+	if (stealable && (this->_sleeping > 0)) {
+		// Anyone may run it, so a burst of pushes wakes a single worker, which wakes the next once it found work.
+		_wake_one();
+	} else if (!stealable || !target->running) {
+		// Only the target may run it, or it has no thread to run it on.
+		target->wake();
+	}
+	_check_backlog();
+	return true;
+}
+
+void datapath::threadpool::pool::_prioritize(job* my_job)
+{
+	// Anything with a deadline is scheduled by it, high priority is due right away and low priority once it aged.
+	if ((my_job->deadline != no_deadline) || (my_job->priority != datapath::threadpool::priority::Normal)) {
+		auto now = std::chrono::steady_clock::now();
+		if (my_job->deadline != no_deadline) {
+			my_job->priority = datapath::threadpool::priority::High;
+		} else if (my_job->priority == datapath::threadpool::priority::High) {
+			my_job->deadline = now;
+		} else {
+			my_job->deadline = now + this->_options.aging;
+		}
+	}
+}
+
+bool datapath::threadpool::pool::push_bulk(const std::shared_ptr<task>* tasks, size_t count)
+{
+	// Early-Exit tests.
+	for (size_t idx = 0; idx < count; idx++) {
+		if (!tasks[idx]) {
+			throw std::invalid_argument("task must not be nullptr");
+		}
+		if (!tasks[idx]->function) {
+			throw std::invalid_argument("task->function must not be nullptr");
+		}
+	}
+
+	std::vector<job*> jobs;
+	jobs.reserve(count);
+	for (size_t idx = 0; idx < count; idx++) {
+		std::shared_ptr<task> my_task = tasks[idx];
+		if (!my_task->mask.is_all()) {
+			push(my_task);
+			continue;
+		}
+
+		jobs.push_back(_make([my_task]() { my_task->function(); }, my_task->priority, my_task->deadline));
 	}
 
-	this->_workers[lowest_id]->push(task);
+	_submit_bulk(jobs.data(), jobs.size());
 	return true;
 }
 
-void datapath::threadpool::pool::clear(affinity_t mask)
+void datapath::threadpool::pool::_submit_bulk(job** jobs, size_t count)
+{
+	if (count == 0) {
+		return;
+	}
+
+	// Deal the jobs out like cards to the running workers, starting at a random one.
+	if (this->_active == 0) {
+		_grow(1);
+	}
+	size_t                         active  = std::min(this->_active.load(), this->_everyone.size());
+	size_t                         workers = std::max<size_t>(active, 1);
+	size_t                         start   = next_random() % workers;
+	std::vector<std::vector<job*>> batches(std::min(count, workers));
+	for (size_t idx = 0; idx < count; idx++) {
+		_prioritize(jobs[idx]);
+		jobs[idx]->stealable = true;
+		batches[idx % batches.size()].push_back(jobs[idx]);
+	}
+	for (size_t idx = 0; idx < batches.size(); idx++) {
+		this->_everyone[(start + idx) % workers]->push(batches[idx].data(), batches[idx].size());
+	}
+	_check_backlog();
+}
+
+size_t datapath::threadpool::pool::_chunk_size(size_t count, size_t grain) const
+{
+	if (grain > 0) {
+		return grain;
+	}
+
+	// A few chunks per worker, so that workers that start late or run slow do not hold up the others.
+	size_t chunks = (this->_everyone.size() + 1) * PARALLEL_CHUNKS_PER_WORKER;
+	return std::max<size_t>(1, (count + chunks - 1) / chunks);
+}
+
+void datapath::threadpool::pool::_parallel(size_t count, size_t size,
+										   const std::function<void(size_t, size_t, size_t)>& body)
+{
+	auto state      = std::make_shared<parallel_state>();
+	state->body     = &body;
+	state->count    = count;
+	state->size     = size;
+	state->chunks   = (count + size - 1) / size;
+	state->next     = 0;
+	state->finished = 0;
+
+	// Helpers take chunks as they get to them, so one that starts late simply finds nothing left.
+	size_t helpers = std::min(state->chunks - 1, this->_everyone.size());
+	if (helpers > 0) {
+		// Asking for this much parallelism is reason enough to start workers right away.
+		_grow(helpers);
+
+		std::vector<job*> jobs;
+		jobs.reserve(helpers);
+		for (size_t idx = 0; idx < helpers; idx++) {
+			jobs.push_back(_make([state]() { parallel_work(*state); }, datapath::threadpool::priority::Normal,
+								 no_deadline));
+		}
+		_submit_bulk(jobs.data(), jobs.size());
+	}
+
+	// Chunks that were taken are being worked on, so waiting for them can not block the pool.
+	parallel_work(*state);
+	std::unique_lock<std::mutex> lock(state->lock);
+	state->signal.wait(lock, [&state]() { return state->finished == state->chunks; });
+	if (state->error) {
+		std::rethrow_exception(state->error);
+	}
+}
+
+void datapath::threadpool::pool::clear(const affinity_t& mask)
 {
 	// Early-Exit tests.
-	if ((mask & (this->_workers.size() - 1)) == 0) {
+	if (mask.empty()) {
 		throw std::invalid_argument("mask does not fit any thread");
 	}
 
-	for (auto kv : _workers) {
-		if ((kv.second->affinity & mask) == 0) {
+	for (auto& worker : this->_workers) {
+		if (!mask.test(worker->index)) {
 			continue;
 		}
 
-		kv.second->clear();
+		worker->clear();
+	}
+}
+
+datapath::threadpool::handle
+	datapath::threadpool::pool::submit(std::function<void()>                            function,
+									   const std::vector<datapath::threadpool::handle>& after,
+									   const affinity_t&                                mask)
+{
+	// Early-Exit tests.
+	if (!function) {
+		throw std::invalid_argument("function must not be nullptr");
+	}
+	if (std::none_of(this->_everyone.begin(), this->_everyone.end(),
+					 [&mask](worker* obj) { return mask.test(obj->index); })) {
+		throw std::invalid_argument("mask does not fit any thread");
+	}
+
+	auto my_node      = std::make_shared<datapath::threadpool::handle::node>();
+	my_node->parent   = this;
+	my_node->function = std::move(function);
+	my_node->mask     = mask;
+	my_node->done     = false;
+
+	// Hold one count ourselves, so that the task can not start while predecessors are still being added.
+	my_node->pending = 1;
+	for (auto& predecessor : after) {
+		if (!predecessor._node) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(predecessor._node->lock);
+		if (!predecessor._node->done) {
+			my_node->pending++;
+			predecessor._node->successors.push_back(my_node);
+		}
+	}
+	if (--my_node->pending == 0) {
+		_schedule(my_node);
+	}
+
+	return datapath::threadpool::handle(my_node);
+}
+
+void datapath::threadpool::pool::_schedule(std::shared_ptr<datapath::threadpool::handle::node> node)
+{
+	push([node]() { _run(node); }, node->mask);
+}
+
+void datapath::threadpool::pool::_run(std::shared_ptr<datapath::threadpool::handle::node> current)
+{
+	while (current) {
+		current->function();
+		current->function = nullptr;
+
+		std::vector<std::shared_ptr<datapath::threadpool::handle::node>> successors;
+		{
+			std::unique_lock<std::mutex> lock(current->lock);
+			current->done = true;
+			successors.swap(current->successors);
+		}
+		current->signal.notify_all();
+
+		// Continue with one of the tasks that became ready, the others go through the queues.
+		worker*                                             self = _current();
+		std::shared_ptr<datapath::threadpool::handle::node> next;
+		for (auto& successor : successors) {
+			if (--successor->pending != 0) {
+				continue;
+			}
+
+			if (!next && self && (self->parent == successor->parent) && successor->mask.test(self->index)) {
+				next = successor;
+			} else {
+				successor->parent->_schedule(successor);
+			}
+		}
+		current = std::move(next);
+	}
+}
+
+datapath::threadpool::handle::handle(std::shared_ptr<node> node) : _node(node) {}
+
+bool datapath::threadpool::handle::valid() const
+{
+	return !!this->_node;
+}
+
+bool datapath::threadpool::handle::done() const
+{
+	return !this->_node || this->_node->done;
+}
+
+void datapath::threadpool::handle::wait() const
+{
+	if (!this->_node) {
+		return;
+	}
+
+	// Blocking a worker could leave the task without anyone to run it, so keep working instead.
+	datapath::threadpool::pool::worker* self = datapath::threadpool::pool::_current();
+	if (self && (self->parent == this->_node->parent)) {
+		while (!this->_node->done) {
+			if (datapath::threadpool::pool::job* my_job = self->find_work()) {
+				my_job->invoke(my_job);
+				my_job->destroy(my_job);
+				datapath::threadpool::pool::_release(my_job);
+			} else {
+				std::this_thread::yield();
+			}
+		}
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(this->_node->lock);
+	this->_node->signal.wait(lock, [this]() { return this->_node->done.load(); });
+}
+
+datapath::threadpool::handle datapath::threadpool::handle::then(std::function<void()> function,
+																const affinity_t&     mask) const
+{
+	// Early-Exit tests.
+	if (!this->_node) {
+		throw std::invalid_argument("handle is empty");
+	}
+
+	return this->_node->parent->submit(std::move(function), {*this}, mask);
+}
+
+void datapath::threadpool::wait_all(const std::vector<datapath::threadpool::handle>& handles)
+{
+	for (auto& obj : handles) {
+		obj.wait();
 	}
 }
@@ -0,0 +1,269 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "topology.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu"
+#define SYSFS_NODE "/sys/devices/system/node/node"
+
+// Highest NUMA node number probed, nodes may be sparse.
+#define SYSFS_NODE_MAX 1024
+
+static bool read_number(const std::string& path, size_t& value)
+{
+	std::ifstream file(path);
+	return static_cast<bool>(file >> value);
+}
+
+// Parse a list in the format of cpulist, such as "0-3,8,10-11".
+static std::vector<size_t> read_list(const std::string& path)
+{
+	std::vector<size_t> values;
+	std::ifstream       file(path);
+	std::string         text;
+	if (!std::getline(file, text)) {
+		return values;
+	}
+
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t      end   = text.find(',', pos);
+		std::string range = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+		size_t      dash  = range.find('-');
+		try {
+			size_t first = std::stoul(range.substr(0, dash));
+			size_t last  = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+			for (size_t value = first; value <= last; value++) {
+				values.push_back(value);
+			}
+		} catch (...) {
+			// Ignore anything we do not understand.
+		}
+		if (end == std::string::npos) {
+			break;
+		}
+		pos = end + 1;
+	}
+	return values;
+}
+#endif
+
+datapath::threadpool::topology::topology() : _cores(0), _packages(0), _nodes(0)
+{
+#ifdef _WIN32
+	DWORD length = 0;
+	GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+	std::vector<char> buffer(length);
+	auto*             info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data());
+	if (length && GetLogicalProcessorInformationEx(RelationAll, info, &length)) {
+		// Collect the relations per logical processor first, they are not reported in any particular order.
+		std::map<size_t, datapath::threadpool::processor> found;
+		size_t                                            core    = 0;
+		size_t                                            package = 0;
+		for (DWORD offset = 0; offset < length;) {
+			auto* item = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data() + offset);
+			offset += item->Size;
+
+			auto apply = [&found, item](const GROUP_AFFINITY& group, size_t value) {
+				for (size_t bit = 0; bit < (sizeof(KAFFINITY) * 8); bit++) {
+					if ((group.Mask & (KAFFINITY(1) << bit)) == 0) {
+						continue;
+					}
+					auto& proc = found[size_t(group.Group) * 64 + bit];
+					proc.id    = size_t(group.Group) * 64 + bit;
+					switch (item->Relationship) {
+					case RelationProcessorCore:
+						proc.core = value;
+						break;
+					case RelationProcessorPackage:
+						proc.package = value;
+						break;
+					case RelationNumaNode:
+						proc.node = value;
+						break;
+					default:
+						break;
+					}
+				}
+			};
+
+			if (item->Relationship == RelationProcessorCore) {
+				for (WORD idx = 0; idx < item->Processor.GroupCount; idx++) {
+					apply(item->Processor.GroupMask[idx], core);
+				}
+				core++;
+			} else if (item->Relationship == RelationProcessorPackage) {
+				for (WORD idx = 0; idx < item->Processor.GroupCount; idx++) {
+					apply(item->Processor.GroupMask[idx], package);
+				}
+				package++;
+			} else if (item->Relationship == RelationNumaNode) {
+				apply(item->NumaNode.GroupMask, item->NumaNode.NodeNumber);
+			}
+		}
+		for (auto& kv : found) {
+			_processors.push_back(kv.second);
+		}
+	}
+#elif defined(__linux__)
+	// Only processors this process is allowed to run on.
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+		std::map<std::pair<size_t, size_t>, size_t> cores;
+		std::map<size_t, size_t>                    packages;
+		for (size_t id = 0; id < CPU_SETSIZE; id++) {
+			if (!CPU_ISSET(id, &allowed)) {
+				continue;
+			}
+
+			// Core ids are only unique within a package, and both may be sparse.
+			size_t      core_id    = id;
+			size_t      package_id = 0;
+			std::string base       = SYSFS_CPU + std::to_string(id) + "/topology/";
+			read_number(base + "core_id", core_id);
+			read_number(base + "physical_package_id", package_id);
+
+			datapath::threadpool::processor proc;
+			proc.id      = id;
+			proc.package = packages.emplace(package_id, packages.size()).first->second;
+			proc.core    = cores.emplace(std::make_pair(package_id, core_id), cores.size()).first->second;
+			proc.node    = 0;
+			_processors.push_back(proc);
+		}
+
+		std::map<size_t, size_t> nodes;
+		for (size_t node = 0; node < SYSFS_NODE_MAX; node++) {
+			std::vector<size_t> cpus = read_list(SYSFS_NODE + std::to_string(node) + "/cpulist");
+			if (cpus.empty()) {
+				continue;
+			}
+			for (auto& proc : _processors) {
+				if (std::find(cpus.begin(), cpus.end(), proc.id) != cpus.end()) {
+					proc.node = nodes.emplace(node, nodes.size()).first->second;
+				}
+			}
+		}
+	}
+#endif
+
+	if (_processors.empty()) {
+		size_t count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		for (size_t id = 0; id < count; id++) {
+			_processors.push_back({id, id, 0, 0});
+		}
+	}
+
+	_finish();
+}
+
+void datapath::threadpool::topology::_finish()
+{
+	for (auto& proc : _processors) {
+		_cores    = std::max(_cores, proc.core + 1);
+		_packages = std::max(_packages, proc.package + 1);
+		_nodes    = std::max(_nodes, proc.node + 1);
+		if (proc.id >= _index.size()) {
+			_index.resize(proc.id + 1, SIZE_MAX);
+		}
+		_index[proc.id] = size_t(&proc - _processors.data());
+	}
+}
+
+const datapath::threadpool::processor* datapath::threadpool::topology::find(size_t id) const
+{
+	if ((id >= _index.size()) || (_index[id] == SIZE_MAX)) {
+		return nullptr;
+	}
+	return &_processors[_index[id]];
+}
+
+size_t datapath::threadpool::topology::current_node() const
+{
+	if (_nodes <= 1) {
+		return 0;
+	}
+
+#ifdef _WIN32
+	PROCESSOR_NUMBER number;
+	GetCurrentProcessorNumberEx(&number);
+	const datapath::threadpool::processor* proc = find(size_t(number.Group) * 64 + number.Number);
+#elif defined(__linux__)
+	int                                    cpu  = sched_getcpu();
+	const datapath::threadpool::processor* proc = (cpu >= 0) ? find(size_t(cpu)) : nullptr;
+#else
+	const datapath::threadpool::processor* proc = nullptr;
+#endif
+	return proc ? proc->node : 0;
+}
+
+const datapath::threadpool::topology& datapath::threadpool::topology::instance()
+{
+	static datapath::threadpool::topology topology;
+	return topology;
+}
+
+void datapath::threadpool::topology::pin(const datapath::threadpool::cpuset& processors)
+{
+	if (processors.is_all()) {
+		return;
+	}
+
+#ifdef _WIN32
+	for (size_t group = 0; group < (processors.size() / 64); group++) {
+		GROUP_AFFINITY affinity = {};
+		affinity.Group          = WORD(group);
+		affinity.Mask           = KAFFINITY(processors.word(group));
+		if (affinity.Mask != 0) {
+			SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+			break;
+		}
+	}
+#elif defined(__linux__)
+	// Sized at runtime, as the machine may have more processors than a cpu_set_t holds.
+	size_t     count = processors.size();
+	cpu_set_t* set   = CPU_ALLOC(count);
+	size_t     size  = CPU_ALLOC_SIZE(count);
+	if (set) {
+		CPU_ZERO_S(size, set);
+		for (size_t id = 0; id < count; id++) {
+			if (processors.test(id)) {
+				CPU_SET_S(id, size, set);
+			}
+		}
+		if (CPU_COUNT_S(size, set) > 0) {
+			pthread_setaffinity_np(pthread_self(), size, set);
+		}
+		CPU_FREE(set);
+	}
+#endif
+}
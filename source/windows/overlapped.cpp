@@ -35,6 +35,9 @@ datapath::windows::overlapped::overlapped() : overlapped_ptr(nullptr), data(null
 datapath::windows::overlapped::~overlapped()
 {
 	cancel();
+	if (overlapped_ptr) {
+		CloseHandle(overlapped_ptr->hEvent);
+	}
 	buffer.clear();
 }
 
@@ -68,7 +71,6 @@ void datapath::windows::overlapped::cancel()
 	if (overlapped_ptr) {
 		CancelIoEx(handle, overlapped_ptr);
 		ResetEvent(overlapped_ptr->hEvent);
-		CloseHandle(overlapped_ptr->hEvent);
 	}
 }
 
@@ -96,3 +98,8 @@ void* datapath::windows::overlapped::get_waitable()
 {
 	return reinterpret_cast<void*>(overlapped_ptr->hEvent);
 }
+
+datapath::windows::overlapped* datapath::windows::overlapped::from(OVERLAPPED* ov)
+{
+	return reinterpret_cast<datapath::windows::overlapped*&>(reinterpret_cast<char*>(ov)[sizeof(OVERLAPPED)]);
+}
@@ -53,6 +53,10 @@ namespace datapath {
 
 			public /*virtual override*/:
 			virtual void* get_waitable() override;
+
+			public:
+			// Object owning an OVERLAPPED, such as the one handed to a completion routine.
+			static overlapped* from(OVERLAPPED* ov);
 		};
 	} // namespace windows
 } // namespace datapath
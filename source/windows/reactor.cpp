@@ -0,0 +1,420 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "reactor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include "socket.hpp"
+#include "topology.hpp"
+
+// Interval in milliseconds at which sockets that asked for it are polled for work that no read completion drives.
+#define REACTOR_TICK_MS 1
+
+// Interval in milliseconds over which the load of each reactor is measured.
+#define REACTOR_BALANCE_MS 100
+
+// Connections only move once the busiest reactor reads this many times the messages of the least busy one.
+#define REACTOR_IMBALANCE_RATIO 2
+
+// Below this many messages per interval a reactor is never considered busy.
+#define REACTOR_IMBALANCE_MIN 1000
+
+datapath::windows::reactor::reactor(std::weak_ptr<datapath::windows::reactor_group> group, size_t index,
+									datapath::threadpool::cpuset processors)
+	: index(index), group(group), processors(processors), shutdown(false), _connections(0), _load(0)
+{
+	this->wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+}
+
+datapath::windows::reactor::~reactor()
+{
+	// The thread holds a reference until it exits, so it is either done or this is running on it.
+	if (this->thread.joinable()) {
+		this->thread.detach();
+	}
+	CloseHandle(this->wake);
+}
+
+std::shared_ptr<datapath::windows::reactor>
+	datapath::windows::reactor::create(std::weak_ptr<datapath::windows::reactor_group> group, size_t index,
+									   datapath::threadpool::cpuset processors)
+{
+	auto obj    = std::make_shared<datapath::windows::reactor>(group, index, processors);
+	obj->thread = std::thread([obj]() { obj->_run(); });
+	return obj;
+}
+
+void datapath::windows::reactor::stop()
+{
+	this->shutdown = true;
+	SetEvent(this->wake);
+	if (this->thread.joinable()) {
+		if (is_current()) {
+			this->thread.detach();
+		} else {
+			this->thread.join();
+		}
+	}
+}
+
+void datapath::windows::reactor::_run()
+{
+	datapath::threadpool::topology::pin(this->processors);
+
+	std::vector<std::function<void()>>      work;
+	std::vector<datapath::windows::socket*> polled;
+	auto                                    next_tick    = std::chrono::steady_clock::now();
+	auto                                    next_balance = next_tick + std::chrono::milliseconds(REACTOR_BALANCE_MS);
+	while (!this->shutdown) {
+		{
+			std::unique_lock<std::mutex> ul(this->lock);
+			std::swap(work, this->commands);
+		}
+		for (auto& fn : work) {
+			fn();
+		}
+		work.clear();
+
+		auto now = std::chrono::steady_clock::now();
+		if (!this->polling.empty() && (now >= next_tick)) {
+			// Sockets that still wait for something queue themselves again.
+			std::swap(polled, this->polling);
+			for (datapath::windows::socket* sock : polled) {
+				auto itr = this->sockets.find(sock);
+				if (itr != this->sockets.end()) {
+					itr->second.polled = false;
+				}
+			}
+			for (datapath::windows::socket* sock : polled) {
+				_service(sock);
+			}
+			polled.clear();
+			next_tick = now + std::chrono::milliseconds(REACTOR_TICK_MS);
+		}
+		if (now >= next_balance) {
+			_balance();
+			next_balance = now + std::chrono::milliseconds(REACTOR_BALANCE_MS);
+		}
+
+		// Completion routines of finished reads run in here, and continue reading on their own. Without sockets to
+		// poll, nothing but a completion, a command or the next balance wakes the reactor.
+		auto until = this->polling.empty() ? next_balance : next_tick;
+		auto wait  = std::chrono::duration_cast<std::chrono::milliseconds>(until - std::chrono::steady_clock::now());
+		WaitForSingleObjectEx(this->wake, DWORD(std::max<int64_t>(wait.count(), 0)), TRUE);
+	}
+}
+
+void datapath::windows::reactor::_schedule(datapath::windows::socket* sock)
+{
+	auto itr = this->sockets.find(sock);
+	if ((itr != this->sockets.end()) && !itr->second.polled) {
+		itr->second.polled = true;
+		this->polling.push_back(sock);
+	}
+}
+
+void datapath::windows::reactor::_service(datapath::windows::socket* ptr)
+{
+	auto itr = this->sockets.find(ptr);
+	if (itr == this->sockets.end()) {
+		return;
+	}
+
+	// Sockets that are being destroyed or closed elsewhere are released by their owner.
+	std::shared_ptr<datapath::windows::socket> sock = itr->second.socket.lock();
+	if (!sock || sock->watcher.shutdown) {
+		return;
+	}
+
+	if (itr->second.target) {
+		// Moving, the completion of the read in flight polls the socket again.
+		if (!sock->_idle()) {
+			return;
+		}
+		sock->_unlock_reader();
+
+		std::shared_ptr<datapath::windows::reactor> target = std::move(itr->second.target);
+		{
+			std::unique_lock<std::mutex> ul(sock->watcher.lock);
+			if (sock->watcher.shutdown) {
+				sock->watcher.moving = false;
+				return;
+			}
+			sock->watcher.reactor = target;
+		}
+		this->sockets.erase(itr);
+		this->_connections--;
+		target->attach(sock);
+		return;
+	}
+
+	// Closing the socket in here releases its entry.
+	if (sock->_poll()) {
+		_schedule(ptr);
+	}
+}
+
+void datapath::windows::reactor::_balance()
+{
+	uint64_t total = 0;
+	for (auto& kv : this->sockets) {
+		// Sockets that are gone wait for their release.
+		entry&                                     item = kv.second;
+		std::shared_ptr<datapath::windows::socket> sock = item.socket.lock();
+		if (!sock) {
+			item.load = 0;
+			continue;
+		}
+		uint64_t count = sock->watcher.messages.load(std::memory_order_relaxed);
+		item.load      = count - item.seen;
+		item.seen      = count;
+		total += item.load;
+	}
+	this->_load.store(total, std::memory_order_relaxed);
+
+	std::shared_ptr<datapath::windows::reactor> target;
+	uint64_t                                    budget = 0;
+	{
+		std::unique_lock<std::mutex> ul(this->lock);
+		target = std::move(this->migration.target);
+		budget = this->migration.budget;
+	}
+	if (target) {
+		// The busiest connection that still fits, moving a larger one would only skew the load the other way.
+		entry* best = nullptr;
+		for (auto& kv : this->sockets) {
+			entry& item = kv.second;
+			if (!item.target && (item.load > 0) && (item.load <= budget) && (!best || (item.load > best->load))) {
+				best = &item;
+			}
+		}
+		if (best) {
+			std::shared_ptr<datapath::windows::socket> sock = best->socket.lock();
+			if (sock) {
+				sock->watcher.moving = true;
+				sock->_cancel(false);
+				best->target = target;
+			}
+		}
+	}
+
+	if (this->index == 0) {
+		if (auto owner = this->group.lock()) {
+			owner->rebalance();
+		}
+	}
+}
+
+void datapath::windows::reactor::_release(datapath::windows::socket*               ptr,
+										  std::shared_ptr<datapath::windows::socket> sock)
+{
+	// A cancelled read still completes, and its completion routine has to run before the socket may go away.
+	if (sock) {
+		sock->_cancel(true);
+		while (!sock->_idle()) {
+			SleepEx(REACTOR_TICK_MS, TRUE);
+		}
+		sock->_unlock_reader();
+		sock->watcher.moving = false;
+	}
+
+	// Not attached if it was closed before its attach ran.
+	if (this->sockets.erase(ptr) > 0) {
+		this->_connections--;
+	}
+}
+
+void datapath::windows::reactor::post(std::function<void()> fn)
+{
+	{
+		std::unique_lock<std::mutex> ul(this->lock);
+		this->commands.push_back(std::move(fn));
+	}
+	SetEvent(this->wake);
+}
+
+bool datapath::windows::reactor::is_current()
+{
+	return this->thread.get_id() == std::this_thread::get_id();
+}
+
+void datapath::windows::reactor::attach(std::shared_ptr<datapath::windows::socket> sock)
+{
+	this->_connections++;
+	post([this, sock]() {
+		// Closed before it got here, its release found nothing to release.
+		if (sock->watcher.shutdown) {
+			sock->watcher.moving = false;
+			this->_connections--;
+			return;
+		}
+
+		entry& item = this->sockets[sock.get()];
+		item.socket = sock;
+		item.seen   = sock->watcher.messages.load(std::memory_order_relaxed);
+
+		sock->watcher.moving = false;
+		_service(sock.get());
+	});
+}
+
+void datapath::windows::reactor::schedule(datapath::windows::socket* sock)
+{
+	if (is_current()) {
+		_schedule(sock);
+		return;
+	}
+	post([this, sock]() { _schedule(sock); });
+}
+
+void datapath::windows::reactor::detach(datapath::windows::socket* sock, std::function<void()> done)
+{
+	// Reactors closing each other's sockets must not wait for one another, so the release keeps the socket alive. A
+	// socket that is being destroyed hands over what its reads in flight use instead.
+	std::shared_ptr<datapath::windows::socket>            self = sock->watcher.anchor->lock();
+	std::shared_ptr<datapath::windows::socket::abandoned> rest;
+	if (!self) {
+		rest = sock->_abandon();
+	}
+
+	auto fn = [this, sock, self, rest, done]() {
+		if (rest) {
+			// Completion routines of a socket that is gone return right away, and are queued once the read is done.
+			rest->header_ov->cancel();
+			rest->content_ov->cancel();
+			while (!rest->header_ov->is_completed() || !rest->content_ov->is_completed()) {
+				SleepEx(REACTOR_TICK_MS, TRUE);
+			}
+			SleepEx(0, TRUE);
+			if (rest->locked) {
+				rest->reader->unlock();
+			}
+		}
+		_release(sock, self);
+		if (done) {
+			done();
+		}
+	};
+	if (is_current()) {
+		fn();
+	} else {
+		post(fn);
+	}
+}
+
+void datapath::windows::reactor::migrate(std::shared_ptr<datapath::windows::reactor> target, uint64_t budget)
+{
+	std::unique_lock<std::mutex> ul(this->lock);
+	this->migration.target = target;
+	this->migration.budget = budget;
+}
+
+datapath::windows::reactor_group::reactor_group(datapath::reactor_policy policy) : policy(policy) {}
+
+datapath::windows::reactor_group::~reactor_group()
+{
+	for (auto& item : this->reactors) {
+		item->stop();
+	}
+}
+
+std::shared_ptr<datapath::windows::reactor> datapath::windows::reactor_group::assign(HANDLE handle)
+{
+	if (this->policy == datapath::reactor_policy::Hash) {
+		// Handles are multiples of four.
+		return this->reactors[(reinterpret_cast<uintptr_t>(handle) >> 2) % this->reactors.size()];
+	}
+
+	std::shared_ptr<datapath::windows::reactor> best = this->reactors[0];
+	for (auto& item : this->reactors) {
+		if ((item->connections() < best->connections())
+			|| ((item->connections() == best->connections()) && (item->load() < best->load()))) {
+			best = item;
+		}
+	}
+	return best;
+}
+
+void datapath::windows::reactor_group::rebalance()
+{
+	if ((this->policy != datapath::reactor_policy::LeastLoaded) || (this->reactors.size() < 2)) {
+		return;
+	}
+
+	std::shared_ptr<datapath::windows::reactor> busiest = this->reactors[0];
+	std::shared_ptr<datapath::windows::reactor> idlest  = this->reactors[0];
+	for (auto& item : this->reactors) {
+		if (item->load() > busiest->load()) {
+			busiest = item;
+		}
+		if (item->load() < idlest->load()) {
+			idlest = item;
+		}
+	}
+
+	if ((busiest == idlest) || (busiest->load() < REACTOR_IMBALANCE_MIN)
+		|| (busiest->load() < (idlest->load() * REACTOR_IMBALANCE_RATIO))) {
+		return;
+	}
+
+	// Moving half the difference evens the two out.
+	busiest->migrate(idlest, (busiest->load() - idlest->load()) / 2);
+}
+
+std::shared_ptr<datapath::windows::reactor_group>
+	datapath::windows::reactor_group::create(const datapath::threadpool::cpuset& processors,
+											 datapath::reactor_policy            policy)
+{
+	// One reactor per core, allowed to run on every processor of that core which is in the set.
+	const datapath::threadpool::topology&          topology = datapath::threadpool::topology::instance();
+	std::map<size_t, datapath::threadpool::cpuset> cores;
+	for (auto& proc : topology.processors()) {
+		if (processors.test(proc.id)) {
+			cores[proc.core].set(proc.id);
+		}
+	}
+	if (cores.empty()) {
+		throw std::invalid_argument("processors does not contain any processor of this machine");
+	}
+
+	auto obj = std::make_shared<datapath::windows::reactor_group>(policy);
+	for (auto& kv : cores) {
+		obj->reactors.push_back(datapath::windows::reactor::create(obj, obj->reactors.size(), kv.second));
+	}
+	return obj;
+}
+
+std::shared_ptr<datapath::windows::reactor_group> datapath::windows::reactor_group::instance()
+{
+	static std::shared_ptr<datapath::windows::reactor_group> group =
+		create(datapath::threadpool::cpuset::all(), datapath::reactor_policy::LeastLoaded);
+	return group;
+}
+
+std::shared_ptr<datapath::windows::reactor_group> datapath::windows::reactor_group::client()
+{
+	// A client usually holds a handful of connections, which do not need a thread per core.
+	static std::shared_ptr<datapath::windows::reactor_group> group = []() {
+		auto obj = std::make_shared<datapath::windows::reactor_group>(datapath::reactor_policy::LeastLoaded);
+		obj->reactors.push_back(datapath::windows::reactor::create(obj, 0, datapath::threadpool::cpuset::all()));
+		return obj;
+	}();
+	return group;
+}
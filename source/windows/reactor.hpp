@@ -0,0 +1,178 @@
+/*
+Low Latency IPC Library for high-speed traffic
+Copyright (C) 2019 Michael Fabian Dirks <info@xaymar.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cpuset.hpp"
+#include "iserver.hpp"
+
+extern "C" {
+#include <Windows.h>
+}
+
+namespace datapath {
+	namespace windows {
+		class socket;
+		class reactor_group;
+
+		/** I/O Reactor
+		 * A single thread reading from many sockets. Reads are issued with ReadFileEx, so their completion routines
+		 * run on this thread while it waits. Idle sockets cost nothing, only sockets waiting for something that no
+		 * completion signals, such as a writer waiting for its queue to drain, are polled until it happened.
+		 */
+		class reactor {
+			struct entry {
+				std::weak_ptr<datapath::windows::socket> socket;
+
+				// Queued for the next poll.
+				bool polled = false;
+
+				// Messages counted at the last balance, and how many arrived in the interval before it.
+				uint64_t seen = 0;
+				uint64_t load = 0;
+
+				// Reactor the socket moves to once it has no read in flight.
+				std::shared_ptr<datapath::windows::reactor> target;
+			};
+
+			size_t                                          index;
+			std::weak_ptr<datapath::windows::reactor_group> group;
+			datapath::threadpool::cpuset                    processors;
+
+			HANDLE            wake;
+			std::thread       thread;
+			std::atomic<bool> shutdown;
+
+			std::atomic<size_t>   _connections;
+			std::atomic<uint64_t> _load;
+
+			// Work handed to the reactor by other threads.
+			std::mutex                         lock;
+			std::vector<std::function<void()>> commands;
+
+			// Set by the group when this reactor should hand a connection to another one.
+			struct {
+				std::shared_ptr<datapath::windows::reactor> target;
+				uint64_t                                    budget = 0;
+			} migration;
+
+			// Only touched on the reactor thread.
+			std::unordered_map<datapath::windows::socket*, entry> sockets;
+			std::vector<datapath::windows::socket*>               polling;
+
+			void _run();
+
+			void _schedule(datapath::windows::socket* sock);
+
+			void _service(datapath::windows::socket* sock);
+
+			void _balance();
+
+			// Without sock the socket is gone, and only its entry is released.
+			void _release(datapath::windows::socket* ptr, std::shared_ptr<datapath::windows::socket> sock);
+
+			public:
+			reactor(std::weak_ptr<datapath::windows::reactor_group> group, size_t index,
+					datapath::threadpool::cpuset processors);
+			~reactor();
+
+			reactor(const reactor&) = delete;
+			reactor& operator=(const reactor&) = delete;
+
+			// Create a reactor and start its thread, which keeps the reactor alive until it is stopped.
+			static std::shared_ptr<datapath::windows::reactor>
+				create(std::weak_ptr<datapath::windows::reactor_group> group, size_t index,
+					   datapath::threadpool::cpuset processors);
+
+			// Stop the thread, waiting for it unless called from it.
+			void stop();
+
+			// Run a function on the reactor thread.
+			void post(std::function<void()> fn);
+
+			bool is_current();
+
+			// Start reading from a socket on this reactor.
+			void attach(std::shared_ptr<datapath::windows::socket> sock);
+
+			// Poll a socket attached to this reactor on its next tick, from any thread.
+			void schedule(datapath::windows::socket* sock);
+
+			/** Stop reading from a socket, from any thread including its destructor.
+			 * Cancels any read in flight without waiting for the reactor, and calls done on the reactor thread once
+			 * the reactor no longer touches the socket or its pipe.
+			 */
+			void detach(datapath::windows::socket* sock, std::function<void()> done);
+
+			// Hand the connection with the most messages, but no more than budget, to another reactor.
+			void migrate(std::shared_ptr<datapath::windows::reactor> target, uint64_t budget);
+
+			inline size_t connections() const
+			{
+				return _connections.load(std::memory_order_relaxed);
+			}
+
+			// Messages read in the last balance interval.
+			inline uint64_t load() const
+			{
+				return _load.load(std::memory_order_relaxed);
+			}
+		};
+
+		/** Reactor Group
+		 * One reactor per core, pinned to that core, shared by all sockets assigned to the group.
+		 */
+		class reactor_group {
+			std::vector<std::shared_ptr<datapath::windows::reactor>> reactors;
+			datapath::reactor_policy                                 policy;
+
+			public:
+			reactor_group(datapath::reactor_policy policy);
+			~reactor_group();
+
+			reactor_group(const reactor_group&) = delete;
+			reactor_group& operator=(const reactor_group&) = delete;
+
+			// Pick the reactor for a new connection.
+			std::shared_ptr<datapath::windows::reactor> assign(HANDLE handle);
+
+			// Move a connection off the busiest reactor if the load is skewed, called by the first reactor.
+			void rebalance();
+
+			public:
+			/** Create a group with one reactor per core that has any of the given processors.
+			 * Throws std::invalid_argument if none of the processors exist.
+			 */
+			static std::shared_ptr<datapath::windows::reactor_group>
+				create(const datapath::threadpool::cpuset& processors, datapath::reactor_policy policy);
+
+			// Group used by accepted sockets that were not given one, covering every core.
+			static std::shared_ptr<datapath::windows::reactor_group> instance();
+
+			// Group used by connected sockets, a single reactor that may run on any processor.
+			static std::shared_ptr<datapath::windows::reactor_group> client();
+		};
+	} // namespace windows
+} // namespace datapath
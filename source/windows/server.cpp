@@ -17,23 +17,31 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "server.hpp"
+#include "reactor.hpp"
 #include "socket.hpp"
 #include "utility.hpp"
 
 // Buffer Size that Windows just ignores, for the most part.
 #define WIN_BUFFER_SIZE 64 * 1024 * 1024
 #define WIN_WAIT_TIME 100
-#define WIN_BACKLOG_NUM 8
+
+// Interval in milliseconds at which connected clients are retried while on_accept has no listeners.
+#define ACCEPT_RETRY_MS 1
 
 datapath::error datapath::windows::server::create(std::string path, datapath::permissions permissions,
-												  size_t max_clients)
+												  size_t max_clients, size_t backlog)
 {
+	if (backlog == 0) {
+		return datapath::error::InvalidParameter;
+	}
+
 	// If old sockets are available, close them.
 	this->close();
 
 	// Apply options
 	this->max_clients = max_clients;
 	this->path        = path;
+	this->backlog     = backlog;
 
 	// Generate Security Attributes.
 	std::memset(&this->security_attributes, 0, sizeof(SECURITY_ATTRIBUTES));
@@ -42,28 +50,25 @@ datapath::error datapath::windows::server::create(std::string path, datapath::pe
 	this->security_attributes.bInheritHandle       = true;
 	// TODO: Respect permissions.
 
+	{
+		std::unique_lock<std::mutex> ul(this->watcher.lock);
+		this->watcher.shutdown = false;
+	}
+
 	// Spawn x backlog connections
-	// TODO: Add parameter for this.
-	for (size_t n = 0; n < WIN_BACKLOG_NUM; n++) {
-		HANDLE handle = _create_socket(path, n == 0);
-		if (handle == INVALID_HANDLE_VALUE) {
+	for (size_t n = 0; n < backlog; n++) {
+		instance* inst = _open(n == 0);
+		if (!inst || !_listen(inst)) {
 			// Clean up again.
 			this->close();
 			return datapath::error::CriticalFailure;
 		}
-
-		{
-			std::unique_lock<std::mutex> ul(this->lock);
-			sockets.push_back(handle);
-			waiting_sockets.push_back(handle);
-		}
 	}
 
 	// Watcher Thread
 	{
 		std::unique_lock<std::mutex> ul(this->watcher.lock);
-		this->watcher.shutdown = false;
-		this->watcher.task     = std::thread(std::bind(&datapath::windows::server::_watcher, this));
+		this->watcher.task = std::thread(std::bind(&datapath::windows::server::_watcher, this));
 	}
 
 	is_created = true;
@@ -89,184 +94,202 @@ HANDLE datapath::windows::server::_create_socket(std::string path, bool initial)
 	return handle;
 }
 
-void datapath::windows::server::_watcher()
+datapath::windows::server::instance* datapath::windows::server::_open(bool initial)
 {
-	std::map<HANDLE, std::shared_ptr<datapath::windows::overlapped>> ovmap;
+	HANDLE handle = _create_socket(this->path, initial);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
 
-	while (!this->watcher.shutdown) {
-		// Wait for any overlapped objects.
-		if (ovmap.size() > 0) {
-			// No lock as we aren't touching any list or map yet.
-			std::vector<datapath::waitable*> waits;
-			waits.reserve(ovmap.size());
+	auto inst    = std::make_shared<instance>();
+	inst->owner  = this;
+	inst->handle = handle;
+	inst->ov     = std::make_shared<datapath::windows::overlapped>();
+	inst->ov->set_handle(handle);
+	inst->ov->set_data(this);
+
+	// The event resets itself when the wait fires, so a single registration serves every client of the instance.
+	if (!RegisterWaitForSingleObject(&inst->wait, inst->ov->get_waitable(), &datapath::windows::server::_on_connected,
+									 inst.get(), INFINITE, WT_EXECUTEINWAITTHREAD)) {
+		CloseHandle(handle);
+		return nullptr;
+	}
 
-			for (auto kv : ovmap) {
-				waits.push_back(&(*kv.second));
-			}
+	this->instances.insert({handle, inst});
+	return inst.get();
+}
 
-			size_t          index = 0;
-			datapath::error ec    = datapath::waitable::wait_any(waits, index, std::chrono::milliseconds(0));
-			if (ec != datapath::error::Success) {
-				datapath::waitable::wait_any(waits, index, std::chrono::milliseconds(1));
-			}
+bool datapath::windows::server::_listen(instance* inst)
+{
+	for (size_t attempt = 0; attempt < 2; attempt++) {
+		inst->ov->reset();
+		SetLastError(ERROR_SUCCESS);
+		if (ConnectNamedPipe(inst->handle, inst->ov->get_overlapped())) {
+			// Completed right away, the event is signaled.
+			break;
 		}
 
-		// Update list of overlappeds to track.
-		{
-			std::unique_lock<std::mutex> ul(this->lock);
-			std::list<HANDLE>            to_kill;
-
-			for (auto itr = this->waiting_sockets.begin(); itr != this->waiting_sockets.end(); itr++) {
-				if (ovmap.count(*itr) == 0) {
-					HANDLE handle = *itr;
-					auto   ov     = std::make_shared<datapath::windows::overlapped>();
-					ov->set_handle(handle);
-					ov->set_data(this);
-					ov->_on_wait_success.add([this, &ovmap, &itr, &handle](datapath::error ec) {
-						std::unique_lock<std::mutex> ul(this->lock);
-						this->waiting_sockets.erase(itr);
-						this->pending_sockets.push_back(handle);
-						ovmap.erase(handle);
-					});
-					SetLastError(ERROR_SUCCESS);
-					BOOL suc = ConnectNamedPipe(handle, ov->get_overlapped());
-					if (suc) {
-						ovmap.insert({handle, ov});
-					} else {
-						if (GetLastError() == ERROR_PIPE_CONNECTED) {
-							to_kill.push_back(handle);
-							this->pending_sockets.push_back(handle);
-						} else {
-							continue;
-						}
-					}
-				}
-			}
-			for (auto hnd : to_kill) {
-				this->waiting_sockets.remove(hnd);
-			}
+		DWORD ec = GetLastError();
+		if (ec == ERROR_IO_PENDING) {
+			break;
+		} else if (ec == ERROR_PIPE_CONNECTED) {
+			// The client was faster than us, which does not signal the event.
+			SetEvent(inst->ov->get_waitable());
+			break;
+		} else if (ec == ERROR_NO_DATA) {
+			// The client already left again, clear the instance and try once more.
+			DisconnectNamedPipe(inst->handle);
+			continue;
 		}
+		return false;
+	}
 
-		// Notify of pending sockets.
-		{
-			std::unique_lock<std::mutex> ul(this->lock);
-			std::list<HANDLE>            to_kill;
-
-			if (this->on_accept) {
-				for (auto itr = this->pending_sockets.begin(); itr != this->pending_sockets.end(); itr++) {
-					HANDLE handle = *itr;
-					bool   accept = true;
-
-					auto sock = std::make_shared<datapath::windows::socket>();
-					sock->_connect(handle);
-
-					auto isock = std::dynamic_pointer_cast<datapath::isocket>(sock);
-					this->on_accept(accept, isock);
-
-					if (accept) {
-						to_kill.push_back(handle);
-						this->active_sockets.insert({handle, sock});
-
-						if ((this->waiting_sockets.size() + this->pending_sockets.size()) < WIN_BACKLOG_NUM) {
-							if ((this->sockets.size() <= this->max_clients) && (this->max_clients > 0)) {
-								HANDLE handle = _create_socket(this->path, false);
-								if (handle != INVALID_HANDLE_VALUE) {
-									this->sockets.push_back(handle);
-									this->waiting_sockets.push_back(handle);
-								}
-							}
-						}
-					} else {
-						// Force close and return to waiting.
-						sock->close();
-						to_kill.push_back(handle);
-						this->waiting_sockets.push_back(handle);
-					}
-				}
-			}
-			for (auto hnd : to_kill) {
-				this->pending_sockets.remove(hnd);
-			}
-		}
+	this->listening++;
+	return true;
+}
 
-		// Verify existing connections.
-		{
-			std::list<HANDLE>            to_kill;
-			std::unique_lock<std::mutex> ul(this->lock);
-			for (auto itr = this->active_sockets.begin(); itr != this->active_sockets.end(); itr++) {
-				if (itr->second.expired()) {
-					// Enforce backlog size
-					if ((this->waiting_sockets.size() + this->pending_sockets.size()) < WIN_BACKLOG_NUM) {
-						this->waiting_sockets.push_back(itr->first);
-					} else {
-						DisconnectNamedPipe(itr->first);
-						CloseHandle(itr->first);
-						to_kill.push_back(itr->first);
-					}
-					this->active_sockets.erase(itr);
-					continue;
-				}
-				auto obj = itr->second.lock();
-				if (!obj->good()) {
-					// Enforce backlog size
-					if ((this->waiting_sockets.size() + this->pending_sockets.size()) < WIN_BACKLOG_NUM) {
-						this->waiting_sockets.push_back(itr->first);
-					} else {
-						DisconnectNamedPipe(itr->first);
-						CloseHandle(itr->first);
-						to_kill.push_back(itr->first);
-					}
-					this->active_sockets.erase(itr);
-					continue;
-				}
-			}
-			for (auto hnd : to_kill) {
-				this->active_sockets.erase(hnd);
-			}
+void datapath::windows::server::_recycle(instance* inst)
+{
+	// Keep up to backlog instances listening, anything beyond that is closed.
+	if ((this->listening < this->backlog) && _listen(inst)) {
+		return;
+	}
+	_destroy(inst);
+}
+
+void datapath::windows::server::_destroy(instance* inst)
+{
+	// Waits for a callback in flight, so nothing refers to the instance afterwards.
+	UnregisterWaitEx(inst->wait, INVALID_HANDLE_VALUE);
+	DisconnectNamedPipe(inst->handle);
+	CloseHandle(inst->handle);
+	this->instances.erase(inst->handle);
+}
+
+void datapath::windows::server::_accept(instance* inst)
+{
+	auto sock = std::make_shared<datapath::windows::socket>();
+
+	std::shared_ptr<datapath::windows::reactor_group> group;
+	{
+		std::unique_lock<std::mutex> ul(this->lock);
+		sock->set_max_message_size(this->max_message.size, this->max_message.policy);
+		sock->set_dispatch(this->dispatch.mode, this->dispatch.pool);
+		group = this->reactors ? this->reactors : datapath::windows::reactor_group::instance();
+	}
+
+	std::weak_ptr<datapath::windows::server> owner = shared_from_this();
+	std::weak_ptr<instance>                  slot  = this->instances[inst->handle];
+
+	// Hands the pipe back once the socket is done with it, whether it was closed or dropped.
+	sock->watcher.release = [owner, slot]() {
+		std::shared_ptr<datapath::windows::server> srv = owner.lock();
+		std::shared_ptr<instance>                  obj = slot.lock();
+		if (srv && obj) {
+			srv->_notify(obj.get(), false);
 		}
+	};
+	sock->_connect(inst->handle, group);
+
+	bool accept = true;
+	auto isock  = std::dynamic_pointer_cast<datapath::isocket>(sock);
+	this->on_accept(accept, isock);
+
+	if (!accept) {
+		// Force close, which returns the instance to listening.
+		sock->close();
+		return;
+	}
 
-		if (ovmap.size() == 0) {
-			// Just sleep 1ms to not use too much CPU.
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	// Replace the instance that was just taken.
+	if ((this->listening < this->backlog) && (this->instances.size() <= this->max_clients)
+		&& (this->max_clients > 0)) {
+		instance* spare = _open(false);
+		if (spare && !_listen(spare)) {
+			_destroy(spare);
 		}
 	}
 }
 
-datapath::windows::server::server() {}
+void datapath::windows::server::_notify(instance* inst, bool connected)
+{
+	{
+		std::unique_lock<std::mutex> ul(this->watcher.lock);
+		if (this->watcher.shutdown) {
+			return;
+		}
+		if (connected) {
+			this->watcher.connected.push_back(inst);
+		} else {
+			this->watcher.released.push_back(inst);
+		}
+	}
+	SetEvent(this->watcher.wake);
+}
 
-datapath::windows::server::~server() {}
+VOID CALLBACK datapath::windows::server::_on_connected(PVOID context, BOOLEAN timed_out)
+{
+	instance* inst = reinterpret_cast<instance*>(context);
+	inst->owner->_notify(inst, true);
+}
 
-/*datapath::error datapath::windows::server::accept(std::shared_ptr<datapath::isocket>& socket)
+void datapath::windows::server::_watcher()
 {
-	std::unique_lock<std::mutex> ul(this->lock);
-	if (this->pending_sockets.size() == 0) {
-		return datapath::error::Failure;
-	}
+	std::vector<instance*> connected;
+	std::vector<instance*> released;
 
-	HANDLE handle = this->pending_sockets.front();
-	this->pending_sockets.pop_front();
+	while (true) {
+		{
+			std::unique_lock<std::mutex> ul(this->watcher.lock);
+			if (this->watcher.shutdown) {
+				break;
+			}
+			std::swap(connected, this->watcher.connected);
+			std::swap(released, this->watcher.released);
+		}
 
-	if (!socket) {
-		socket = std::dynamic_pointer_cast<datapath::isocket>(std::make_shared<datapath::windows::socket>());
-	}
-	std::shared_ptr<datapath::windows::socket> obj = std::dynamic_pointer_cast<datapath::windows::socket>(socket);
+		for (instance* inst : connected) {
+			this->listening--;
 
-	obj->_connect(handle);
+			DWORD transferred = 0;
+			if (GetOverlappedResult(inst->handle, inst->ov->get_overlapped(), &transferred, FALSE)) {
+				this->pending.push_back(inst);
+			} else {
+				DisconnectNamedPipe(inst->handle);
+				_recycle(inst);
+			}
+		}
+		connected.clear();
+
+		// Before accepting, so that replacements for closed connections count towards the backlog.
+		for (instance* inst : released) {
+			_recycle(inst);
+		}
+		released.clear();
 
-	// Stock up on backlog and total sockets.
-	if ((this->waiting_sockets.size() + this->pending_sockets.size()) < WIN_BACKLOG_NUM) {
-		if ((this->sockets.size() <= this->max_clients) && (this->max_clients > 0)) {
-			HANDLE handle = _create_socket(this->path, false);
-			if (handle != INVALID_HANDLE_VALUE) {
-				this->sockets.push_back(handle);
-				this->waiting_sockets.push_back(handle);
+		if (this->on_accept) {
+			while (!this->pending.empty()) {
+				instance* inst = this->pending.front();
+				this->pending.pop_front();
+				_accept(inst);
 			}
 		}
+
+		// Only wake up periodically while clients wait for someone to accept them.
+		WaitForSingleObject(this->watcher.wake, this->pending.empty() ? INFINITE : ACCEPT_RETRY_MS);
 	}
+}
 
-	this->active_sockets.insert({handle, socket});
-	return datapath::error::Success;
-}*/
+datapath::windows::server::server()
+{
+	this->watcher.wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+}
+
+datapath::windows::server::~server()
+{
+	close();
+	CloseHandle(this->watcher.wake);
+}
 
 datapath::error datapath::windows::server::close()
 {
@@ -274,36 +297,67 @@ datapath::error datapath::windows::server::close()
 	{
 		std::unique_lock<std::mutex> ul(this->watcher.lock);
 		this->watcher.shutdown = true;
-		if (this->watcher.task.joinable()) {
+	}
+	SetEvent(this->watcher.wake);
+	if (this->watcher.task.joinable()) {
+		if (this->watcher.task.get_id() == std::this_thread::get_id()) {
+			this->watcher.task.detach();
+		} else {
 			this->watcher.task.join();
 		}
 	}
 
 	// Kill all sockets.
-	std::unique_lock<std::mutex> ul(this->lock);
-	for (HANDLE socket : sockets) {
-		DisconnectNamedPipe(socket);
-		CloseHandle(socket);
+	while (!this->instances.empty()) {
+		_destroy(this->instances.begin()->second.get());
 	}
 
 	// Notify Sockets of being dead.
 
 	// Clear all lists.
-	sockets.clear();
-	waiting_sockets.clear();
-	pending_sockets.clear();
-	active_sockets.clear();
+	{
+		std::unique_lock<std::mutex> ul(this->watcher.lock);
+		this->watcher.connected.clear();
+		this->watcher.released.clear();
+	}
+	this->pending.clear();
+	this->listening = 0;
 
 	return datapath::error::Success;
 }
 
+void datapath::windows::server::set_max_message_size(size_t size, datapath::oversize_policy policy)
+{
+	this->max_message.size   = size;
+	this->max_message.policy = policy;
+}
+
+void datapath::windows::server::set_dispatch(datapath::dispatch_mode                     mode,
+											 std::shared_ptr<datapath::threadpool::pool> pool)
+{
+	std::unique_lock<std::mutex> ul(this->lock);
+	this->dispatch.mode = mode;
+	this->dispatch.pool = pool;
+}
+
+void datapath::windows::server::set_reactors(const datapath::threadpool::cpuset& processors,
+											 datapath::reactor_policy            policy)
+{
+	// Created outside of the lock, as it starts a thread per core.
+	std::shared_ptr<datapath::windows::reactor_group> group =
+		datapath::windows::reactor_group::create(processors, policy);
+
+	std::unique_lock<std::mutex> ul(this->lock);
+	this->reactors = group;
+}
+
 datapath::error datapath::windows::server::host(std::shared_ptr<datapath::iserver>& server, std::string path,
-												datapath::permissions permissions, size_t max_clients)
+												datapath::permissions permissions, size_t max_clients, size_t backlog)
 {
 	if (!server) {
 		server = std::dynamic_pointer_cast<datapath::iserver>(std::make_shared<datapath::windows::server>());
 	}
 	std::shared_ptr<datapath::windows::server> obj = std::dynamic_pointer_cast<datapath::windows::server>(server);
 
-	return obj->create(path, permissions, max_clients);
+	return obj->create(path, permissions, max_clients, backlog);
 }
@@ -22,7 +22,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 #include "iserver.hpp"
+#include "overlapped.hpp"
 #include "permissions.hpp"
 
 extern "C" {
@@ -31,33 +33,79 @@ extern "C" {
 
 namespace datapath {
 	namespace windows {
+		class reactor_group;
+
 		class server : public iserver, public std::enable_shared_from_this<datapath::windows::server> {
 			bool        is_created  = false;
 			size_t      max_clients = -1;
 			std::string path;
 
+			struct {
+				size_t                    size   = datapath::default_max_message;
+				datapath::oversize_policy policy = datapath::oversize_policy::Close;
+			} max_message;
+
+			struct {
+				datapath::dispatch_mode                     mode = datapath::dispatch_mode::Inline;
+				std::shared_ptr<datapath::threadpool::pool> pool;
+			} dispatch;
+
+			// Reactors reading accepted sockets, the shared group if not set.
+			std::shared_ptr<datapath::windows::reactor_group> reactors;
+
 			private /*critical data*/:
 			// Lock for critical data.
 			std::mutex lock;
 
 			SECURITY_ATTRIBUTES security_attributes;
 
-			std::list<HANDLE>                                  sockets;
-			std::list<HANDLE>                                  waiting_sockets;
-			std::list<HANDLE>                                  pending_sockets;
-			std::map<HANDLE, std::weak_ptr<datapath::isocket>> active_sockets;
+			// A pipe instance, either listening for a client or handed to a socket.
+			struct instance {
+				datapath::windows::server*                     owner;
+				HANDLE                                         handle = INVALID_HANDLE_VALUE;
+				std::shared_ptr<datapath::windows::overlapped> ov;
+
+				// Registered once, fires every time a client connects to the instance.
+				HANDLE wait = NULL;
+			};
+
+			// Only touched by the watcher thread while it runs.
+			size_t                                      backlog   = 0;
+			size_t                                      listening = 0;
+			std::map<HANDLE, std::shared_ptr<instance>> instances;
+			std::list<instance*>                        pending;
 
 			struct {
 				std::thread task;
+				HANDLE      wake;
 				std::mutex  lock;
 				bool        shutdown = false;
+
+				// Instances a client connected to, and instances whose socket let go of the pipe.
+				std::vector<instance*> connected;
+				std::vector<instance*> released;
 			} watcher;
 
 			protected:
-			datapath::error create(std::string path, datapath::permissions permissions, size_t max_clients);
+			datapath::error create(std::string path, datapath::permissions permissions, size_t max_clients,
+								   size_t backlog);
 
 			HANDLE _create_socket(std::string path, bool initial = false);
 
+			instance* _open(bool initial);
+
+			bool _listen(instance* inst);
+
+			void _recycle(instance* inst);
+
+			void _destroy(instance* inst);
+
+			void _accept(instance* inst);
+
+			void _notify(instance* inst, bool connected);
+
+			static VOID CALLBACK _on_connected(PVOID context, BOOLEAN timed_out);
+
 			void _watcher();
 
 			public:
@@ -70,9 +118,17 @@ namespace datapath {
 			public /*virtual override*/:
 			virtual datapath::error close() override;
 
+			virtual void set_max_message_size(size_t size, datapath::oversize_policy policy) override;
+
+			virtual void set_dispatch(datapath::dispatch_mode                     mode,
+									  std::shared_ptr<datapath::threadpool::pool> pool) override;
+
+			virtual void set_reactors(const datapath::threadpool::cpuset& processors,
+									  datapath::reactor_policy            policy) override;
+
 			public:
 			static datapath::error host(std::shared_ptr<datapath::iserver>& server, std::string path,
-										datapath::permissions permissions, size_t max_clients);
+										datapath::permissions permissions, size_t max_clients, size_t backlog);
 		};
 	} // namespace windows
 } // namespace datapath
@@ -17,153 +17,525 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "socket.hpp"
+#include <algorithm>
 #include <cinttypes>
+#include <cstring>
+#include <limits>
 #include "task.hpp"
 #include "utility.hpp"
 
-#define SIZE_ELEMENT uint32_t
+// Messages up to this size are sent from preallocated per-socket tasks and received without reallocation.
+#define SMALL_MESSAGE_SIZE 256
+#define SMALL_MESSAGE_SLOTS 16
 
-void datapath::windows::socket::_connect(HANDLE handle)
+// Default send queue limits for try_write().
+#define SEND_QUEUE_HIGH_BYTES 16 * 1024 * 1024
+#define SEND_QUEUE_HIGH_MESSAGES 4096
+#define SEND_QUEUE_LOW_BYTES 4 * 1024 * 1024
+#define SEND_QUEUE_LOW_MESSAGES 1024
+
+// Consumed credit is piggy-backed on outgoing messages once it reaches 1/8th of the window, and sent on its own
+// once it reaches half of the window.
+#define CREDIT_PIGGYBACK_DIVISOR 8
+#define CREDIT_GRANT_DIVISOR 2
+
+// Control frames are tiny, anything larger is a corrupt or hostile header.
+#define MAX_CONTROL_SIZE 64
+
+// Upper bound for messages handed to a single on_message_batch call.
+#define BATCH_MESSAGES_MAX 64
+
+// Serialized callbacks run by one pool task before it yields the worker to other tasks.
+#define DISPATCH_DRAIN_MAX 64
+
+void datapath::windows::socket::_connect(HANDLE handle, std::shared_ptr<datapath::windows::reactor_group> group)
 {
 	this->socket_handle = handle;
 	if (handle != INVALID_HANDLE_VALUE) {
 		this->is_connected = true;
+		this->reader.ov->set_handle(handle);
+		this->watcher.header_ov->set_handle(handle);
+		this->watcher.content_ov->set_handle(handle);
 
+		{
+			std::unique_lock<std::mutex> ul(this->dispatcher.lock);
+			this->dispatcher.self = shared_from_this();
+		}
+		*this->watcher.anchor = shared_from_this();
+
+		std::shared_ptr<datapath::windows::reactor> reactor = group->assign(handle);
 		{
 			std::unique_lock<std::mutex> ul(this->watcher.lock);
 			this->watcher.shutdown = false;
-			this->watcher.task     = std::thread(std::bind(&datapath::windows::socket::_watcher, this));
+			this->watcher.drop     = false;
+			this->watcher.group    = group;
+			this->watcher.reactor  = reactor;
 		}
+		reactor->attach(shared_from_this());
 	}
 }
 
 void datapath::windows::socket::_disconnect()
 {
 	if (this->on_close) {
-		this->on_close();
+		// Through the dispatcher, so in Serialized mode it runs after every message queued before it.
+		_execute([this]() { this->on_close(); });
 	}
 
+	std::function<void()>                       release;
+	std::shared_ptr<datapath::windows::reactor> reactor;
 	{
-		{
-			std::unique_lock<std::mutex> ul(this->watcher.lock);
-			this->watcher.shutdown = true;
+		std::unique_lock<std::mutex> ul(this->watcher.lock);
+		this->watcher.shutdown = true;
+		reactor                = this->watcher.reactor;
+		std::swap(release, this->watcher.release);
+	}
+
+	// Does not wait for the reactor, which hands the pipe back to the server once it no longer reads from it.
+	if (reactor) {
+		reactor->detach(this, release);
+	} else if (release) {
+		release();
+	}
+}
+
+VOID CALLBACK datapath::windows::socket::_completion(DWORD error, DWORD transferred, LPOVERLAPPED ov)
+{
+	datapath::windows::overlapped* obj    = datapath::windows::overlapped::from(ov);
+	auto*                          anchor = static_cast<std::weak_ptr<datapath::windows::socket>*>(obj->get_data());
+
+	// Keep the socket alive in case a listener drops the last reference to it. Once it is gone, its release only waits
+	// for the read to complete and keeps the overlapped object and the buffer until then.
+	std::shared_ptr<datapath::windows::socket> self = anchor->lock();
+	if (!self) {
+		return;
+	}
+	datapath::windows::socket* sock = self.get();
+	if (sock->watcher.shutdown) {
+		sock->watcher.state            = readstate::Unknown;
+		sock->watcher.oversized.active = false;
+		return;
+	}
+
+	if (error != ERROR_SUCCESS) {
+		sock->watcher.state            = readstate::Unknown;
+		sock->watcher.oversized.active = false;
+		if (error != ERROR_OPERATION_ABORTED) {
+			// The pipe broke.
+			sock->watcher.drop = true;
 		}
-		if (this->watcher.task.joinable()) {
-			this->watcher.task.join();
+	} else {
+		if (obj == sock->watcher.header_ov.get()) {
+			sock->_on_header();
+		} else {
+			sock->_on_content(transferred);
 		}
+		sock->_pump();
 	}
 
-	this->is_connected = false;
+	// Reading stopped, the reactor moves or closes the socket.
+	if (sock->watcher.moving || sock->watcher.drop) {
+		sock->_schedule();
+	}
 }
 
-void datapath::windows::socket::_watcher()
+bool datapath::windows::socket::_poll()
 {
-	enum class readstate { Unknown, Header, Content } state = readstate::Unknown;
+	if ((this->socket_handle == INVALID_HANDLE_VALUE) || !this->is_connected) {
+		return false;
+	}
 
-	std::vector<char> read_buffer;
+	_pump();
+	if (this->watcher.drop) {
+		// The peer sent something we refuse to read, or the pipe broke.
+		this->close();
+		return false;
+	}
 
-	std::shared_ptr<datapath::windows::overlapped> read_header_ov  = std::make_shared<datapath::windows::overlapped>();
-	std::shared_ptr<datapath::windows::overlapped> read_content_ov = std::make_shared<datapath::windows::overlapped>();
-	std::shared_ptr<datapath::windows::overlapped> waitable;
+	// Hand the pipe back between messages.
+	if (_idle()) {
+		_unlock_reader();
+	}
 
-	read_header_ov->_on_wait_error.add([&state, &waitable](datapath::error ec) {
-		// There was an error waiting on the header.
-		state = readstate::Unknown;
-		waitable.reset();
-	});
-	read_header_ov->_on_wait_success.add([this, &read_buffer, &read_content_ov, &state, &waitable](datapath::error ec) {
-		read_content_ov->set_handle(this->socket_handle);
-		read_content_ov->set_data(this);
+	// Track completed writes so that on_writable is raised even if nobody is writing.
+	_reap_writes();
+	bool blocked;
+	{
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		blocked = this->send_queue.blocked;
+	}
 
-		// ToDo: Add optional message size limit, messages above this size kill the connection for attempting DoS.
-		size_t msg_size = reinterpret_cast<SIZE_ELEMENT&>(read_buffer[0]);
-		read_buffer.resize(msg_size);
+	// Listeners without a read in flight, such as a frame receive() left unfinished, or one that is not visible yet.
+	bool listening = this->on_message || this->on_message_batch;
+	if (listening) {
+		this->watcher.added = false;
+	}
+	return blocked || this->watcher.added || (listening && _idle() && !this->watcher.moving);
+}
 
-		// Read content.
-		if (ReadFileEx(this->socket_handle, read_buffer.data(), DWORD(read_buffer.size()),
-					   read_content_ov->get_overlapped(), &datapath::windows::utility::def_io_completion_routine)) {
-			state    = readstate::Content;
-			waitable = read_content_ov;
-		} else {
-			state = readstate::Unknown;
-			waitable.reset();
-		}
-	});
-	read_content_ov->_on_wait_error.add([&state, &waitable](datapath::error ec) {
-		// There was an error waiting on the content.
-		state = readstate::Unknown;
-		waitable.reset();
-	});
-	read_content_ov->_on_wait_success.add([this, &read_buffer, &state, &waitable](datapath::error ec) {
-		// We have content!
-		if (this->on_message) {
-			this->on_message(read_buffer);
-			state = readstate::Unknown;
+void datapath::windows::socket::_schedule()
+{
+	std::shared_ptr<datapath::windows::reactor> reactor;
+	{
+		std::unique_lock<std::mutex> ul(this->watcher.lock);
+		reactor = this->watcher.reactor;
+	}
+	if (reactor) {
+		reactor->schedule(this);
+	}
+}
+
+void datapath::windows::socket::_listen()
+{
+	// Called before the listener is published, so the reactor keeps polling until it shows up.
+	this->watcher.added = true;
+	_schedule();
+}
+
+void datapath::windows::socket::_pump()
+{
+	if (!_idle() || this->watcher.shutdown || this->watcher.moving || this->watcher.drop) {
+		return;
+	}
+
+	// Without listeners the pipe is left to receive(), which reads on the calling thread.
+	if (!(this->on_message || this->on_message_batch)) {
+		return;
+	}
+	if (!this->watcher.reader.owns_lock() && !this->watcher.reader.try_lock()) {
+		return;
+	}
+
+	if (this->reader.buffered) {
+		this->reader.buffered = false;
+		this->_dispatch(this->reader.buffer);
+		this->watcher.messages.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// receive() stopped in the middle of a frame, finish it without waiting before reading on our own.
+	if (this->reader.frame.header_read > 0) {
+		std::vector<char>& message = this->watcher.buffer;
+		message.clear();
+		if (_read_frame(message, std::chrono::high_resolution_clock::now()) == datapath::error::Success) {
+			this->_dispatch(message);
+			this->watcher.messages.fetch_add(1, std::memory_order_relaxed);
+		}
+		return;
+	}
+
+	// Read the header of the next message.
+	// The header simply contains the length of the message.
+	// ToDo: Figure out if Message transfer/read mode and WaitCommEvent work together.
+	this->watcher.buffer.resize(sizeof(SIZE_ELEMENT));
+	if (ReadFileEx(this->socket_handle, this->watcher.buffer.data(), DWORD(this->watcher.buffer.size()),
+				   this->watcher.header_ov->get_overlapped(), &datapath::windows::socket::_completion)) {
+		this->watcher.state = readstate::Header;
+	} else {
+		// The pipe broke.
+		this->watcher.drop = true;
+		_unlock_reader();
+	}
+}
+
+void datapath::windows::socket::_on_header()
+{
+	// Check the size before allocating anything for the message.
+	SIZE_ELEMENT header   = reinterpret_cast<SIZE_ELEMENT&>(this->watcher.buffer[0]);
+	size_t       msg_size = header & ~CONTROL_FLAG;
+	this->watcher.control = (header & CONTROL_FLAG) != 0;
+	this->watcher.state   = readstate::Unknown;
+	if (this->watcher.control && (msg_size > MAX_CONTROL_SIZE)) {
+		this->watcher.drop = true;
+	} else if (!this->watcher.control && (this->max_message.size > 0) && (msg_size > this->max_message.size)) {
+		if (this->max_message.policy == datapath::oversize_policy::Close) {
+			this->watcher.drop = true;
 		} else {
-			// We're buffering the message in read_buffer until there is a hook to on_message.
+			this->watcher.oversized.active = true;
+			this->watcher.oversized.offset = 0;
+			this->watcher.oversized.total  = msg_size;
+			_read_part();
+			return;
 		}
-		waitable.reset();
-	});
+	}
+	if (this->watcher.drop) {
+		return;
+	}
+	this->watcher.buffer.resize(msg_size);
 
-	while (!this->watcher.shutdown) {
-		if (this->socket_handle == INVALID_HANDLE_VALUE) {
-			break;
+	// A zero byte read on a pipe waits for more data to arrive, empty messages are complete already.
+	if (msg_size == 0) {
+		_on_content(0);
+		return;
+	}
+
+	// Read content.
+	if (ReadFileEx(this->socket_handle, this->watcher.buffer.data(), DWORD(this->watcher.buffer.size()),
+				   this->watcher.content_ov->get_overlapped(), &datapath::windows::socket::_completion)) {
+		this->watcher.state = readstate::Content;
+	} else {
+		this->watcher.drop = true;
+	}
+}
+
+void datapath::windows::socket::_on_content(DWORD transferred)
+{
+	// Listeners may close the socket, which waits for the reactor to see no read in flight.
+	this->watcher.state = readstate::Unknown;
+
+	if (this->watcher.oversized.active) {
+		this->watcher.buffer.resize(transferred);
+
+		if ((this->max_message.policy == datapath::oversize_policy::Stream) && this->on_message_part) {
+			this->on_message_part(this->watcher.buffer, this->watcher.oversized.offset, this->watcher.oversized.total);
 		}
-		if (!this->is_connected) {
-			break;
+
+		this->watcher.oversized.offset += transferred;
+		if (this->watcher.shutdown) {
+			this->watcher.oversized.active = false;
+		} else if (this->watcher.oversized.offset < this->watcher.oversized.total) {
+			_read_part();
+		} else {
+			this->watcher.oversized.active = false;
+			this->_consume(this->watcher.oversized.total);
 		}
+		return;
+	}
 
-		if (state == readstate::Unknown) {
-			// Read the header of the next message.
-			// The header simply contains the length of the message.
-			// ToDo: Figure out if Message transfer/read mode and WaitCommEvent work together.
+	// We have content!
+	if (this->watcher.control) {
+		this->_control(this->watcher.buffer);
+	} else if (this->on_message || this->on_message_batch) {
+		this->_dispatch(this->watcher.buffer);
+		this->watcher.messages.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		// The last listener went away during the read, keep the message for the next receive() or listener.
+		std::swap(this->reader.buffer, this->watcher.buffer);
+		this->reader.buffered = true;
+	}
 
-			read_header_ov->set_handle(this->socket_handle);
-			read_header_ov->set_data(this);
-			read_buffer.resize(sizeof(SIZE_ELEMENT));
+	// Hand the pipe back between messages.
+	_unlock_reader();
+}
 
-			// Read content.
-			if (ReadFileEx(this->socket_handle, read_buffer.data(), DWORD(read_buffer.size()),
-						   read_header_ov->get_overlapped(), &datapath::windows::utility::def_io_completion_routine)) {
-				state    = readstate::Header;
-				waitable = read_header_ov;
+void datapath::windows::socket::_read_part()
+{
+	this->watcher.buffer.resize(
+		std::min(this->max_message.size, this->watcher.oversized.total - this->watcher.oversized.offset));
+	if (ReadFileEx(this->socket_handle, this->watcher.buffer.data(), DWORD(this->watcher.buffer.size()),
+				   this->watcher.content_ov->get_overlapped(), &datapath::windows::socket::_completion)) {
+		this->watcher.state = readstate::Content;
+	} else {
+		this->watcher.state = readstate::Unknown;
+		this->watcher.drop  = true;
+	}
+}
 
-			} else {
-				state = readstate::Unknown;
-				waitable.reset();
-			}
-		} else if (state == readstate::Header) {
-			// This logic is in the on_wait_success handler.
-		} else if (state == readstate::Content) {
-			// This logic is in the on_wait_success handler, and continued here.
-			if (!waitable) {
-				// We currently have a message buffered, but there was no handler last time we checked.
-				if (this->on_message) {
-					this->on_message(read_buffer);
-					state = readstate::Unknown;
-				}
+void datapath::windows::socket::_cancel(bool content)
+{
+	if (this->watcher.state == readstate::Header) {
+		this->watcher.header_ov->cancel();
+	} else if (content && (this->watcher.state == readstate::Content)) {
+		this->watcher.content_ov->cancel();
+	}
+}
+
+void datapath::windows::socket::_unlock_reader()
+{
+	if (this->watcher.reader.owns_lock()) {
+		this->watcher.reader.unlock();
+	}
+}
+
+std::shared_ptr<datapath::windows::socket::abandoned> datapath::windows::socket::_abandon()
+{
+	auto obj        = std::make_shared<abandoned>();
+	obj->anchor     = this->watcher.anchor;
+	obj->header_ov  = this->watcher.header_ov;
+	obj->content_ov = this->watcher.content_ov;
+	std::swap(obj->buffer, this->watcher.buffer);
+
+	// Locked on the reactor thread, which unlocks it once the reads completed.
+	obj->reader = this->reader.lock;
+	obj->locked = this->watcher.reader.owns_lock();
+	this->watcher.reader.release();
+	return obj;
+}
+
+std::shared_ptr<datapath::windows::task> datapath::windows::socket::_acquire_small_task()
+{
+	std::unique_lock<std::mutex> ul(this->small_tasks.lock);
+	for (size_t n = 0; n < this->small_tasks.tasks.size(); n++) {
+		size_t idx = (this->small_tasks.next + n) % this->small_tasks.tasks.size();
+		auto&  obj = this->small_tasks.tasks[idx];
+		if ((obj.use_count() == 1) && obj->overlapped->is_completed()) {
+			this->small_tasks.next = idx + 1;
+			return obj;
+		}
+	}
+	return nullptr;
+}
+
+void datapath::windows::socket::_reap_writes()
+{
+	bool writable = false;
+	{
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		auto&                        tasks = this->send_queue.tasks;
+		// Writes on a pipe complete in the order they were issued, so only the front needs to be checked. Writers
+		// racing to queue their task only delay the accounting of a completed write until the one before it is done.
+		while (!tasks.empty() && tasks.front().task->is_completed()) {
+			this->send_queue.bytes -= tasks.front().bytes;
+			tasks.pop_front();
+		}
+
+		if (this->send_queue.blocked) {
+			datapath::watermark& low    = this->send_queue.low;
+			auto&                credit = this->send_queue.credit;
+			if ((this->send_queue.bytes <= low.bytes) && (tasks.size() <= low.messages)
+				&& (!credit.enabled || ((credit.bytes > 0) && (credit.messages > 0)))) {
+				this->send_queue.blocked = false;
+				writable                 = true;
 			}
 		}
+	}
 
-		if (!waitable) {
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	if (writable && this->on_writable) {
+		this->on_writable();
+	}
+}
+
+bool datapath::windows::socket::_take_credit(datapath::protocol::credit& credit, size_t divisor)
+{
+	std::unique_lock<std::mutex> ul(this->receive_window.lock);
+	datapath::watermark&         window = this->receive_window.window;
+	if ((window.bytes == 0) && (window.messages == 0)) {
+		return false;
+	}
+
+	if (((window.bytes == 0) || (this->receive_window.bytes < (window.bytes / divisor)))
+		&& ((window.messages == 0) || (this->receive_window.messages < (window.messages / divisor)))) {
+		return false;
+	}
+
+	credit.type     = datapath::protocol::control::Credit;
+	credit.bytes    = uint32_t(window.bytes > 0 ? this->receive_window.bytes : 0);
+	credit.messages = uint32_t(window.messages > 0 ? this->receive_window.messages : 0);
+
+	this->receive_window.bytes    = 0;
+	this->receive_window.messages = 0;
+	return true;
+}
+
+void datapath::windows::socket::_send_credit(const datapath::protocol::credit& credit)
+{
+	std::shared_ptr<datapath::itask> task;
+	if (_write(task, nullptr, 0, &credit, false) == datapath::error::Success) {
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		this->send_queue.tasks.push_back({std::dynamic_pointer_cast<datapath::windows::task>(task), task->length()});
+		this->send_queue.bytes += task->length();
+	}
+}
+
+void datapath::windows::socket::_consume(size_t length, size_t messages)
+{
+	{
+		std::unique_lock<std::mutex> ul(this->receive_window.lock);
+		if ((this->receive_window.window.bytes == 0) && (this->receive_window.window.messages == 0)) {
+			return;
+		}
+		this->receive_window.bytes += length;
+		this->receive_window.messages += messages;
+	}
+
+	datapath::protocol::credit credit;
+	if (_take_credit(credit, CREDIT_GRANT_DIVISOR)) {
+		_send_credit(credit);
+	}
+}
+
+void datapath::windows::socket::_control(const std::vector<char>& data)
+{
+	if ((data.size() < sizeof(datapath::protocol::control))
+		|| (datapath::protocol::control(data[0]) != datapath::protocol::control::Credit)
+		|| (data.size() < sizeof(datapath::protocol::credit))) {
+		// Unknown control frames are ignored for forward compatibility.
+		return;
+	}
+
+	datapath::protocol::credit grant;
+	std::memcpy(&grant, data.data(), sizeof(datapath::protocol::credit));
+
+	{
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		auto&                        credit = this->send_queue.credit;
+		if ((grant.bytes == datapath::protocol::credit_unlimited)
+			&& (grant.messages == datapath::protocol::credit_unlimited)) {
+			credit.enabled = false;
 		} else {
-			datapath::error err = waitable->wait(std::chrono::milliseconds(0));
-			if (err != datapath::error::Success) {
-				err = waitable->wait(std::chrono::milliseconds(1));
+			if (!credit.enabled) {
+				credit.enabled  = true;
+				credit.bytes    = 0;
+				credit.messages = 0;
 			}
-			if (err == datapath::error::Closed) {
-				_disconnect();
-				continue;
+			if (grant.bytes == datapath::protocol::credit_unlimited) {
+				credit.bytes = std::numeric_limits<int64_t>::max();
+			} else if (credit.bytes != std::numeric_limits<int64_t>::max()) {
+				credit.bytes += grant.bytes;
+			}
+			if (grant.messages == datapath::protocol::credit_unlimited) {
+				credit.messages = std::numeric_limits<int64_t>::max();
+			} else if (credit.messages != std::numeric_limits<int64_t>::max()) {
+				credit.messages += grant.messages;
 			}
 		}
 	}
+
+	// May have unblocked the sending side.
+	_reap_writes();
 }
 
-datapath::windows::socket::socket() : is_connected(false), socket_handle(INVALID_HANDLE_VALUE) {}
+datapath::windows::socket::socket()
+	: is_connected(false), socket_handle(INVALID_HANDLE_VALUE), write_mode(datapath::write_mode::Queued)
+{
+	this->send_queue.high.bytes    = SEND_QUEUE_HIGH_BYTES;
+	this->send_queue.high.messages = SEND_QUEUE_HIGH_MESSAGES;
+	this->send_queue.low.bytes     = SEND_QUEUE_LOW_BYTES;
+	this->send_queue.low.messages  = SEND_QUEUE_LOW_MESSAGES;
+
+	this->reader.ov = std::make_shared<datapath::windows::overlapped>();
+	this->reader.control.reserve(MAX_CONTROL_SIZE);
+
+	this->reader.lock        = std::make_shared<std::timed_mutex>();
+	this->watcher.reader     = std::unique_lock<std::timed_mutex>(*this->reader.lock, std::defer_lock);
+	this->watcher.header_ov  = std::make_shared<datapath::windows::overlapped>();
+	this->watcher.content_ov = std::make_shared<datapath::windows::overlapped>();
+	this->watcher.anchor     = std::make_shared<std::weak_ptr<datapath::windows::socket>>();
+	this->watcher.header_ov->set_data(this->watcher.anchor.get());
+	this->watcher.content_ov->set_data(this->watcher.anchor.get());
+	this->watcher.buffer.reserve(sizeof(SIZE_ELEMENT) + SMALL_MESSAGE_SIZE);
+	this->batch.offsets.reserve(BATCH_MESSAGES_MAX);
+	this->batch.views.reserve(BATCH_MESSAGES_MAX);
+
+	this->small_tasks.tasks.reserve(SMALL_MESSAGE_SLOTS);
+	for (size_t idx = 0; idx < SMALL_MESSAGE_SLOTS; idx++) {
+		auto obj        = std::make_shared<datapath::windows::task>();
+		obj->overlapped = std::make_shared<datapath::windows::overlapped>();
+		obj->buffer.reserve(sizeof(SIZE_ELEMENT) + SMALL_MESSAGE_SIZE);
+		this->small_tasks.tasks.push_back(obj);
+	}
+
+	// Nothing is read while there are no listeners, so adding one has to tell the reactor.
+	this->on_message.on_add = [this](decltype(this->on_message)&, decltype(this->on_message)::function_t&) {
+		_listen();
+	};
+	this->on_message_batch.on_add = [this](decltype(this->on_message_batch)&,
+										   decltype(this->on_message_batch)::function_t&) { _listen(); };
+}
 
 datapath::windows::socket::~socket()
 {
+	// Detaches from the reactor, which keeps what a read in flight uses until that read completed.
 	close();
 }
 
@@ -174,7 +546,8 @@ bool datapath::windows::socket::good()
 
 datapath::error datapath::windows::socket::close()
 {
-	if (this->is_connected) {
+	// The reactor dropping the pipe and the user may close at the same time, only one of them gets to disconnect.
+	if (this->is_connected.exchange(false)) {
 		DisconnectNamedPipe(this->socket_handle);
 		_disconnect();
 		return datapath::error::Success;
@@ -182,15 +555,194 @@ datapath::error datapath::windows::socket::close()
 	return datapath::error::Closed;
 }
 
-datapath::error datapath::windows::socket::write(std::shared_ptr<datapath::itask>& task, const std::vector<char>& data)
+void datapath::windows::socket::set_write_mode(datapath::write_mode mode)
+{
+	this->write_mode = mode;
+}
+
+void datapath::windows::socket::set_max_message_size(size_t size, datapath::oversize_policy policy)
+{
+	this->max_message.size   = size;
+	this->max_message.policy = policy;
+}
+
+void datapath::windows::socket::set_write_watermarks(datapath::watermark high, datapath::watermark low)
+{
+	{
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		this->send_queue.high = high;
+		this->send_queue.low  = low;
+	}
+	_reap_writes();
+}
+
+void datapath::windows::socket::set_dispatch(datapath::dispatch_mode                     mode,
+											 std::shared_ptr<datapath::threadpool::pool> pool)
+{
+	std::unique_lock<std::mutex> ul(this->dispatcher.lock);
+	this->dispatcher.pool = pool;
+	this->dispatcher.mode.store(mode, std::memory_order_relaxed);
+}
+
+void datapath::windows::socket::set_flow_control(datapath::watermark window)
 {
+	{
+		std::unique_lock<std::mutex> ul(this->receive_window.lock);
+		this->receive_window.window   = window;
+		this->receive_window.bytes    = 0;
+		this->receive_window.messages = 0;
+	}
+
+	// Grant the initial window, or tell the peer to stop enforcing it.
+	datapath::protocol::credit credit;
+	credit.type     = datapath::protocol::control::Credit;
+	credit.bytes    = uint32_t(std::min<size_t>(window.bytes, datapath::protocol::credit_unlimited - 1));
+	credit.messages = uint32_t(std::min<size_t>(window.messages, datapath::protocol::credit_unlimited - 1));
+	if (window.bytes == 0) {
+		credit.bytes = datapath::protocol::credit_unlimited;
+	}
+	if (window.messages == 0) {
+		credit.messages = datapath::protocol::credit_unlimited;
+	}
+	_send_credit(credit);
+}
+
+datapath::error datapath::windows::socket::write(std::shared_ptr<datapath::itask>& task, const char* data,
+												 size_t length)
+{
+	_reap_writes();
+	return _send(task, data, length, false);
+}
+
+datapath::error datapath::windows::socket::try_write(std::shared_ptr<datapath::itask>& task, const char* data,
+													 size_t length)
+{
+	_reap_writes();
+
+	{
+		// Checked and reserved in one go, so that concurrent writers can not overshoot the watermark together.
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		datapath::watermark&         high     = this->send_queue.high;
+		auto&                        reserved = this->send_queue.reserved;
+		if (((high.bytes > 0)
+			 && ((this->send_queue.bytes + reserved.bytes + sizeof(SIZE_ELEMENT) + length) > high.bytes))
+			|| ((high.messages > 0) && ((this->send_queue.tasks.size() + reserved.messages + 1) > high.messages))) {
+			this->send_queue.blocked = true;
+			ul.unlock();
+
+			// Completed writes are only reaped by the reactor from here on, until on_writable was raised.
+			_schedule();
+			return datapath::error::WouldBlock;
+		}
+		reserved.bytes += sizeof(SIZE_ELEMENT) + length;
+		reserved.messages++;
+	}
+
+	return _send(task, data, length, true);
+}
+
+datapath::error datapath::windows::socket::_send(std::shared_ptr<datapath::itask>& task, const char* data,
+												 size_t length, bool reserved)
+{
+	// The top bit of the size marks control frames, so larger messages can not be framed.
+	datapath::error ec = (length < CONTROL_FLAG) ? datapath::error::Success : datapath::error::InvalidParameter;
+
+	datapath::protocol::credit grant;
+	bool                       has_grant = false;
+	bool                       charged   = false;
+	if (ec == datapath::error::Success) {
+		has_grant = _take_credit(grant, CREDIT_PIGGYBACK_DIVISOR);
+
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		auto&                        credit = this->send_queue.credit;
+		if (credit.enabled && ((credit.bytes <= 0) || (credit.messages <= 0))) {
+			this->send_queue.blocked = true;
+			ec                       = datapath::error::WouldBlock;
+		} else if (credit.enabled) {
+			credit.bytes -= int64_t(length);
+			credit.messages--;
+			charged = true;
+		}
+	}
+	if (ec == datapath::error::Success) {
+		ec = _write(task, data, length, has_grant ? &grant : nullptr);
+	}
+
+	{
+		// Room reserved by try_write is taken over by the queued write, or given back.
+		std::unique_lock<std::mutex> ul(this->send_queue.lock);
+		if (reserved) {
+			this->send_queue.reserved.bytes -= sizeof(SIZE_ELEMENT) + length;
+			this->send_queue.reserved.messages--;
+		}
+		if (ec == datapath::error::Success) {
+			size_t bytes = task->length();
+			this->send_queue.tasks.push_back({std::dynamic_pointer_cast<datapath::windows::task>(task), bytes});
+			this->send_queue.bytes += bytes;
+			return ec;
+		}
+		if (charged) {
+			this->send_queue.credit.bytes += int64_t(length);
+			this->send_queue.credit.messages++;
+		}
+	}
+
+	if (ec == datapath::error::WouldBlock) {
+		if (has_grant) {
+			_send_credit(grant);
+		}
+		_schedule();
+	} else if (has_grant) {
+		// Return the grant so it is not lost.
+		std::unique_lock<std::mutex> ul(this->receive_window.lock);
+		this->receive_window.bytes += grant.bytes;
+		this->receive_window.messages += grant.messages;
+	}
+	return ec;
+}
+
+datapath::error datapath::windows::socket::_write(std::shared_ptr<datapath::itask>& task, const char* data,
+												  size_t length, const datapath::protocol::credit* credit, bool message)
+{
+	std::shared_ptr<datapath::windows::task> obj;
+	if (!task && ((length + (credit ? sizeof(SIZE_ELEMENT) + sizeof(datapath::protocol::credit) : 0))
+				  <= SMALL_MESSAGE_SIZE)) {
+		// Small messages use a preallocated task, which avoids all allocations if one is free.
+		obj = _acquire_small_task();
+		if (obj) {
+			task = obj;
+		}
+	}
 	if (!task) {
 		task = std::dynamic_pointer_cast<datapath::itask>(std::make_shared<datapath::windows::task>());
 	}
-	std::shared_ptr<datapath::windows::task>       obj = std::dynamic_pointer_cast<datapath::windows::task>(task);
-	std::shared_ptr<datapath::windows::overlapped> ov  = std::make_shared<datapath::windows::overlapped>();
+	if (!obj) {
+		obj = std::dynamic_pointer_cast<datapath::windows::task>(task);
+	}
+
+	// Reuse the overlapped of a completed task instead of creating a new event for every write.
+	std::shared_ptr<datapath::windows::overlapped> ov = obj->overlapped;
+	if (ov && ov->is_completed()) {
+		ov->reset();
+	} else {
+		ov = std::make_shared<datapath::windows::overlapped>();
+	}
+	ov->set_handle(this->socket_handle);
 
-	obj->_assign(data, ov);
+	obj->_assign(data, length, message, ov, credit);
+
+	if (this->write_mode == datapath::write_mode::Opportunistic) {
+		// On an uncongested pipe this completes right here, otherwise the system finishes the write in the
+		// background and signals the event of the overlapped, so no thread has to be woken up for it.
+		SetLastError(ERROR_SUCCESS);
+		if (WriteFile(socket_handle, obj->data().data(), DWORD(obj->data().size()), NULL, ov->get_overlapped())) {
+			return datapath::error::Success;
+		} else if (GetLastError() == ERROR_IO_PENDING) {
+			return datapath::error::Success;
+		} else {
+			return datapath::error::Failure;
+		}
+	}
 
 	BOOL suc = WriteFileEx(socket_handle, obj->data().data(), DWORD(obj->data().size()), ov->get_overlapped(),
 						   &datapath::windows::utility::def_io_completion_routine);
@@ -201,6 +753,405 @@ datapath::error datapath::windows::socket::write(std::shared_ptr<datapath::itask
 	}
 }
 
+datapath::error datapath::windows::socket::_wait_readable(std::chrono::high_resolution_clock::time_point deadline)
+{
+	OVERLAPPED* ov = this->reader.ov->get_overlapped();
+	char        dummy;
+	while (true) {
+		DWORD available = 0;
+		if (!PeekNamedPipe(this->socket_handle, NULL, 0, NULL, &available, NULL)) {
+			return datapath::error::Closed;
+		}
+		if (available > 0) {
+			return datapath::error::Success;
+		}
+
+		auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			deadline - std::chrono::high_resolution_clock::now());
+		if (remaining.count() <= 0) {
+			return datapath::error::TimedOut;
+		}
+
+		// A zero byte read completes once data arrives, without taking any of it from the pipe.
+		this->reader.ov->reset();
+		SetLastError(ERROR_SUCCESS);
+		if (ReadFile(this->socket_handle, &dummy, 0, NULL, ov)) {
+			continue;
+		} else if (GetLastError() != ERROR_IO_PENDING) {
+			return datapath::error::Closed;
+		}
+
+		DWORD transferred = 0;
+		DWORD timeout     = DWORD((remaining.count() + 999999) / 1000000);
+		if (WaitForSingleObject(ov->hEvent, timeout) != WAIT_OBJECT_0) {
+			CancelIoEx(this->socket_handle, ov);
+			GetOverlappedResult(this->socket_handle, ov, &transferred, TRUE);
+			return datapath::error::TimedOut;
+		}
+		if (!GetOverlappedResult(this->socket_handle, ov, &transferred, FALSE)) {
+			return datapath::error::Closed;
+		}
+	}
+}
+
+datapath::error datapath::windows::socket::_read_exact(char* data, size_t length, size_t& done,
+													   std::chrono::high_resolution_clock::time_point deadline)
+{
+	OVERLAPPED* ov = this->reader.ov->get_overlapped();
+	while (done < length) {
+		DWORD transferred = 0;
+		this->reader.ov->reset();
+		SetLastError(ERROR_SUCCESS);
+		if (!ReadFile(this->socket_handle, data + done, DWORD(length - done), NULL, ov)
+			&& (GetLastError() != ERROR_IO_PENDING)) {
+			return datapath::error::Closed;
+		}
+
+		if (!this->reader.ov->is_completed()) {
+			auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				deadline - std::chrono::high_resolution_clock::now());
+			DWORD timeout = remaining.count() > 0 ? DWORD((remaining.count() + 999999) / 1000000) : 0;
+			if (WaitForSingleObject(ov->hEvent, timeout) != WAIT_OBJECT_0) {
+				// Whatever arrived before the cancel is kept, the caller continues from there.
+				CancelIoEx(this->socket_handle, ov);
+				GetOverlappedResult(this->socket_handle, ov, &transferred, TRUE);
+				done += transferred;
+				return (done < length) ? datapath::error::TimedOut : datapath::error::Success;
+			}
+		}
+		if (!GetOverlappedResult(this->socket_handle, ov, &transferred, FALSE)) {
+			return datapath::error::Closed;
+		}
+		done += transferred;
+	}
+	return datapath::error::Success;
+}
+
+datapath::error datapath::windows::socket::_read_frame(std::vector<char>&                             buffer,
+													   std::chrono::high_resolution_clock::time_point deadline)
+{
+	// Every step records its progress in reader.frame, so a frame cut short by the deadline is continued by the next
+	// call instead of losing its place in the stream.
+	auto& frame = this->reader.frame;
+	while (true) {
+		datapath::error ec;
+		if (frame.header_read == 0) {
+			ec = _wait_readable(deadline);
+			if (ec != datapath::error::Success) {
+				return ec;
+			}
+		}
+
+		if (frame.header_read < sizeof(SIZE_ELEMENT)) {
+			ec = _read_exact(reinterpret_cast<char*>(&frame.header), sizeof(SIZE_ELEMENT), frame.header_read,
+							 deadline);
+			if (ec != datapath::error::Success) {
+				return ec;
+			}
+			frame.offset = 0;
+			frame.read   = 0;
+		}
+		size_t msg_size = frame.header & ~CONTROL_FLAG;
+
+		if (frame.header & CONTROL_FLAG) {
+			if (msg_size > MAX_CONTROL_SIZE) {
+				this->close();
+				return datapath::error::Closed;
+			}
+			this->reader.control.resize(msg_size);
+			ec = _read_exact(this->reader.control.data(), msg_size, frame.read, deadline);
+			if (ec != datapath::error::Success) {
+				return ec;
+			}
+			frame.header_read = 0;
+			this->_control(this->reader.control);
+			continue;
+		}
+
+		if ((this->max_message.size > 0) && (msg_size > this->max_message.size)) {
+			if (this->max_message.policy == datapath::oversize_policy::Close) {
+				this->close();
+				return datapath::error::Closed;
+			}
+
+			// Skipped and streamed messages never reach the caller, read them in pieces of at most the limit.
+			std::vector<char>& part = this->reader.part;
+			while (frame.offset < msg_size) {
+				part.resize(std::min(this->max_message.size, msg_size - frame.offset));
+				ec = _read_exact(part.data(), part.size(), frame.read, deadline);
+				if (ec != datapath::error::Success) {
+					return ec;
+				}
+				if ((this->max_message.policy == datapath::oversize_policy::Stream) && this->on_message_part) {
+					this->on_message_part(part, frame.offset, msg_size);
+				}
+				frame.offset += part.size();
+				frame.read = 0;
+			}
+			frame.header_read = 0;
+			this->_consume(msg_size);
+			continue;
+		}
+
+		// Append, so that batches can be read back to back into one buffer.
+		size_t             offset  = buffer.size();
+		std::vector<char>& partial = this->reader.partial;
+		if (frame.read == 0) {
+			buffer.resize(offset + msg_size);
+			ec = _read_exact(buffer.data() + offset, msg_size, frame.read, deadline);
+			if (ec != datapath::error::Success) {
+				// The next call may read into another buffer, so keep the part that arrived with the reader.
+				partial.assign(buffer.begin() + offset, buffer.begin() + offset + frame.read);
+				buffer.resize(offset);
+				return ec;
+			}
+		} else {
+			partial.resize(msg_size);
+			ec = _read_exact(partial.data(), msg_size, frame.read, deadline);
+			if (ec != datapath::error::Success) {
+				return ec;
+			}
+			if (offset == 0) {
+				std::swap(buffer, partial);
+			} else {
+				buffer.insert(buffer.end(), partial.begin(), partial.end());
+			}
+			partial.clear();
+		}
+		frame.header_read = 0;
+		return datapath::error::Success;
+	}
+}
+
+datapath::error datapath::windows::socket::_receive(std::vector<char>&                             buffer,
+													std::chrono::high_resolution_clock::time_point deadline)
+{
+	if (this->reader.buffered) {
+		this->reader.buffered = false;
+		std::swap(buffer, this->reader.buffer);
+		this->_consume(buffer.size());
+		return datapath::error::Success;
+	}
+
+	buffer.clear();
+	datapath::error ec = _read_frame(buffer, deadline);
+	if (ec == datapath::error::Success) {
+		this->_consume(buffer.size());
+	}
+	return ec;
+}
+
+void datapath::windows::socket::_collect(delivery& item, std::vector<char>& message)
+{
+	std::vector<char>&   storage = item.storage;
+	std::vector<size_t>& offsets = item.offsets;
+	std::swap(storage, message);
+	offsets.clear();
+	offsets.push_back(0);
+	if (!this->on_message_batch) {
+		return;
+	}
+
+	// Pick up everything else that already arrived, and hand it over in one call. This runs on the reactor thread, so
+	// only frames that arrived in full are read, anything else is left to the reactor.
+	while (offsets.size() < BATCH_MESSAGES_MAX) {
+		SIZE_ELEMENT header    = 0;
+		DWORD        peeked    = 0;
+		DWORD        available = 0;
+		if (!PeekNamedPipe(this->socket_handle, &header, sizeof(SIZE_ELEMENT), &peeked, &available, NULL)
+			|| (peeked < sizeof(SIZE_ELEMENT))) {
+			break;
+		}
+		size_t msg_size = header & ~CONTROL_FLAG;
+		if ((header & CONTROL_FLAG) ? (msg_size > MAX_CONTROL_SIZE)
+									: ((this->max_message.size > 0) && (msg_size > this->max_message.size))) {
+			break;
+		}
+		if ((available - sizeof(SIZE_ELEMENT)) < msg_size) {
+			break;
+		}
+
+		size_t offset = storage.size();
+		if (_read_frame(storage, std::chrono::high_resolution_clock::now()) != datapath::error::Success) {
+			break;
+		}
+		offsets.push_back(offset);
+	}
+}
+
+void datapath::windows::socket::_deliver(delivery& item)
+{
+	std::vector<char>&   storage = item.storage;
+	std::vector<size_t>& offsets = item.offsets;
+	size_t               length  = storage.size();
+	size_t               count   = offsets.size();
+
+	if (!this->on_message_batch) {
+		if (count == 1) {
+			this->on_message(storage);
+		} else {
+			// The last batch listener went away while this was queued, fall back to one message at a time.
+			std::vector<char> message;
+			for (size_t idx = 0; idx < count; idx++) {
+				size_t end = (idx + 1 < count) ? offsets[idx + 1] : storage.size();
+				message.assign(storage.begin() + offsets[idx], storage.begin() + end);
+				this->on_message(message);
+			}
+		}
+	} else {
+		// Views are only built once all messages are read, as reading may move the storage.
+		std::vector<datapath::message_view>& views = item.views;
+		views.resize(count);
+		for (size_t idx = 0; idx < count; idx++) {
+			size_t end      = (idx + 1 < count) ? offsets[idx + 1] : storage.size();
+			views[idx].data = storage.data() + offsets[idx];
+			views[idx].size = end - offsets[idx];
+		}
+		this->on_message_batch(views.data(), views.size());
+	}
+
+	// Credit only goes back once the listener is done, so a slow listener holds the peer back instead of queueing up
+	// whatever it sends.
+	this->_consume(length, count);
+}
+
+void datapath::windows::socket::_dispatch(std::vector<char>& message)
+{
+	if (this->dispatcher.mode.load(std::memory_order_relaxed) == datapath::dispatch_mode::Inline) {
+		_collect(this->batch, message);
+		_deliver(this->batch);
+		return;
+	}
+
+	// The message leaves the reader, so it needs a buffer of its own.
+	auto item = std::make_shared<delivery>();
+	_collect(*item, message);
+	_execute([this, item]() { _deliver(*item); });
+}
+
+void datapath::windows::socket::_execute(std::function<void()> fn)
+{
+	datapath::dispatch_mode                     mode = this->dispatcher.mode.load(std::memory_order_relaxed);
+	std::shared_ptr<datapath::threadpool::pool> pool;
+	std::shared_ptr<datapath::windows::socket>  self;
+	if (mode != datapath::dispatch_mode::Inline) {
+		std::unique_lock<std::mutex> ul(this->dispatcher.lock);
+		pool = this->dispatcher.pool;
+		self = this->dispatcher.self.lock();
+	}
+
+	// Without a pool, or while the socket is being destroyed, there is nothing to hand over to.
+	if (!pool || !self) {
+		fn();
+		return;
+	}
+
+	if (mode == datapath::dispatch_mode::Parallel) {
+		pool->push([self, fn]() { fn(); });
+		return;
+	}
+
+	// Serialized: queue behind earlier callbacks, and start the strand if nobody is draining it.
+	{
+		std::unique_lock<std::mutex> ul(this->dispatcher.lock);
+		this->dispatcher.queue.push_back(std::move(fn));
+		if (this->dispatcher.running) {
+			return;
+		}
+		this->dispatcher.running = true;
+	}
+	pool->push([self]() { self->_drain(); });
+}
+
+void datapath::windows::socket::_drain()
+{
+	// Bounded, so one busy socket can not hold on to a pool worker forever.
+	for (size_t idx = 0; idx < DISPATCH_DRAIN_MAX; idx++) {
+		std::function<void()> fn;
+		{
+			std::unique_lock<std::mutex> ul(this->dispatcher.lock);
+			if (this->dispatcher.queue.empty()) {
+				this->dispatcher.running = false;
+				return;
+			}
+			fn = std::move(this->dispatcher.queue.front());
+			this->dispatcher.queue.pop_front();
+		}
+		fn();
+	}
+
+	// Still running, continue behind whatever else the pool has to do.
+	std::shared_ptr<datapath::threadpool::pool> pool;
+	{
+		std::unique_lock<std::mutex> ul(this->dispatcher.lock);
+		pool = this->dispatcher.pool;
+	}
+	auto self = shared_from_this();
+	if (pool) {
+		pool->push([self]() { self->_drain(); });
+	} else {
+		self->_drain();
+	}
+}
+
+datapath::error datapath::windows::socket::receive(std::vector<char>& buffer, std::chrono::nanoseconds timeout)
+{
+	auto deadline = std::chrono::high_resolution_clock::now() + timeout;
+	if (!this->is_connected) {
+		return datapath::error::Closed;
+	}
+	if (this->on_message || this->on_message_batch) {
+		return datapath::error::NotSupported;
+	}
+
+	std::unique_lock<std::timed_mutex> ul(*this->reader.lock, std::defer_lock);
+	if (!ul.try_lock_for(timeout)) {
+		return datapath::error::TimedOut;
+	}
+	return _receive(buffer, deadline);
+}
+
+datapath::error datapath::windows::socket::receive_batch(std::vector<char>* buffers, size_t capacity, size_t& count,
+														 std::chrono::nanoseconds timeout)
+{
+	auto deadline = std::chrono::high_resolution_clock::now() + timeout;
+	count         = 0;
+	if (!this->is_connected) {
+		return datapath::error::Closed;
+	}
+	if (this->on_message || this->on_message_batch) {
+		return datapath::error::NotSupported;
+	}
+	if (capacity == 0) {
+		return datapath::error::Success;
+	}
+
+	std::unique_lock<std::timed_mutex> ul(*this->reader.lock, std::defer_lock);
+	if (!ul.try_lock_for(timeout)) {
+		return datapath::error::TimedOut;
+	}
+
+	datapath::error ec = _receive(buffers[0], deadline);
+	if (ec != datapath::error::Success) {
+		return ec;
+	}
+	count = 1;
+
+	// Only take what has already arrived, never wait for more.
+	while (count < capacity) {
+		DWORD available = 0;
+		if (!PeekNamedPipe(this->socket_handle, NULL, 0, NULL, &available, NULL)
+			|| (available < sizeof(SIZE_ELEMENT))) {
+			break;
+		}
+		if (_receive(buffers[count], std::chrono::high_resolution_clock::now()) != datapath::error::Success) {
+			break;
+		}
+		count++;
+	}
+	return datapath::error::Success;
+}
+
 datapath::error datapath::windows::socket::connect(std::shared_ptr<datapath::isocket>& socket, std::string path)
 {
 	if (!datapath::windows::utility::make_pipe_path(path)) {
@@ -227,7 +1178,7 @@ datapath::error datapath::windows::socket::connect(std::shared_ptr<datapath::iso
 	}
 	std::shared_ptr<datapath::windows::socket> obj = std::dynamic_pointer_cast<datapath::windows::socket>(socket);
 
-	obj->_connect(handle);
+	obj->_connect(handle, datapath::windows::reactor_group::client());
 
 	return datapath::error::Success;
 }
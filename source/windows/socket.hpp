@@ -17,14 +17,22 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include "event.hpp"
 #include "isocket.hpp"
 #include "overlapped-queue.hpp"
 #include "overlapped.hpp"
+#include "protocol.hpp"
+#include "reactor.hpp"
 #include "server.hpp"
+#include "threadpool.hpp"
 
 extern "C" {
 #include <Windows.h>
@@ -32,22 +40,232 @@ extern "C" {
 
 namespace datapath {
 	namespace windows {
+		class task;
+
 		class socket : public isocket, public std::enable_shared_from_this<datapath::windows::socket> {
-			bool   is_connected;
-			HANDLE socket_handle;
+			std::atomic<bool>    is_connected;
+			HANDLE               socket_handle;
+			datapath::write_mode write_mode;
+
+			struct {
+				size_t                    size   = datapath::default_max_message;
+				datapath::oversize_policy policy = datapath::oversize_policy::Close;
+			} max_message;
+
+			// Preallocated tasks for small messages, free when only the socket holds a reference.
+			struct {
+				std::mutex                                            lock;
+				std::vector<std::shared_ptr<datapath::windows::task>> tasks;
+				size_t                                                next = 0;
+			} small_tasks;
+
+			// A queued write with the bytes it added to the queue, the task may be reused before it is reaped.
+			struct queued {
+				std::shared_ptr<datapath::windows::task> task;
+				size_t                                   bytes;
+			};
+
+			// Writes that have not completed yet, in the order they were issued.
+			struct {
+				std::mutex          lock;
+				std::deque<queued>  tasks;
+				size_t              bytes = 0;
+				datapath::watermark high;
+				datapath::watermark low;
+				bool                blocked = false;
+
+				// Room taken by try_write for a write that is not queued yet.
+				struct {
+					size_t bytes    = 0;
+					size_t messages = 0;
+				} reserved;
 
+				// Credit granted by the peer, only enforced once the peer enabled flow control.
+				struct {
+					bool    enabled  = false;
+					int64_t bytes    = 0;
+					int64_t messages = 0;
+				} credit;
+			} send_queue;
+
+			// Reading side of the pipe, owned by the reactor while on_message has listeners.
 			struct {
-				std::thread task;
-				std::mutex  lock;
-				bool        shutdown = false;
+				std::shared_ptr<std::timed_mutex>              lock;
+				std::shared_ptr<datapath::windows::overlapped> ov;
+				std::vector<char>                              control;
+				std::vector<char>                              part;
+
+				// Message read by the reactor after the last listener was removed.
+				std::vector<char> buffer;
+				bool              buffered = false;
+
+				// Frame a read stopped in at its deadline, continued by the next read.
+				struct {
+					SIZE_ELEMENT header      = 0;
+					size_t       header_read = 0;
+					size_t       offset      = 0;
+					size_t       read        = 0;
+				} frame;
+				std::vector<char> partial;
+			} reader;
+
+			// Messages handed to listeners in one go, stored back to back.
+			struct delivery {
+				std::vector<char>                   storage;
+				std::vector<size_t>                 offsets;
+				std::vector<datapath::message_view> views;
+			};
+
+			// Reused for inline dispatch, deliveries handed to a thread pool are allocated per message.
+			delivery batch;
+
+			// Where listeners run, see set_dispatch.
+			struct {
+				std::atomic<datapath::dispatch_mode>        mode{datapath::dispatch_mode::Inline};
+				std::mutex                                  lock;
+				std::shared_ptr<datapath::threadpool::pool> pool;
+				std::weak_ptr<datapath::windows::socket>    self;
+
+				// Serialized callbacks waiting for the strand, drained by at most one pool worker at a time.
+				std::deque<std::function<void()>> queue;
+				bool                              running = false;
+			} dispatcher;
+
+			// Credit granted to the peer.
+			struct {
+				std::mutex          lock;
+				datapath::watermark window;
+				size_t              bytes    = 0;
+				size_t              messages = 0;
+			} receive_window;
+
+			enum class readstate : int8_t { Unknown, Header, Content };
+
+			// Reading driven by the reactor the socket is attached to, only touched on its thread unless noted.
+			struct {
+				// Protects group, reactor and release, group and reactor change as the socket moves between reactors.
+				std::mutex                                        lock;
+				std::shared_ptr<datapath::windows::reactor_group> group;
+				std::shared_ptr<datapath::windows::reactor>       reactor;
+				std::atomic<bool>                                 shutdown{false};
+
+				// Set by the server that accepted the socket, called once the socket no longer uses the pipe.
+				std::function<void()> release;
+
+				// Held while a read is in flight, so that receive() does not read from the pipe at the same time.
+				std::unique_lock<std::timed_mutex> reader;
+
+				readstate                                      state   = readstate::Unknown;
+				bool                                           moving  = false;
+				bool                                           control = false;
+				bool                                           drop    = false;
+				std::vector<char>                              buffer;
+				std::shared_ptr<datapath::windows::overlapped> header_ov;
+				std::shared_ptr<datapath::windows::overlapped> content_ov;
+
+				// Data of both overlapped objects, a read may complete after the socket is gone.
+				std::shared_ptr<std::weak_ptr<datapath::windows::socket>> anchor;
+
+				// Messages above the size limit are read in pieces of at most the limit.
+				struct {
+					bool   active = false;
+					size_t offset = 0;
+					size_t total  = 0;
+				} oversized;
+
+				// Messages read so far, any thread, used to balance load between reactors.
+				std::atomic<uint64_t> messages{0};
+
+				// A listener was added, any thread, the reactor polls until it sees it.
+				std::atomic<bool> added{false};
 			} watcher;
 
+			// What the reads in flight of a socket that is being destroyed still use, kept by the reactor until then.
+			struct abandoned {
+				std::shared_ptr<std::weak_ptr<datapath::windows::socket>> anchor;
+				std::shared_ptr<datapath::windows::overlapped>            header_ov;
+				std::shared_ptr<datapath::windows::overlapped>            content_ov;
+				std::vector<char>                                         buffer;
+				std::shared_ptr<std::timed_mutex>                         reader;
+				bool                                                      locked = false;
+			};
+
 			protected:
-			void _connect(HANDLE handle);
+			void _connect(HANDLE handle, std::shared_ptr<datapath::windows::reactor_group> group);
 
 			void _disconnect();
 
-			void _watcher();
+			static VOID CALLBACK _completion(DWORD error, DWORD transferred, LPOVERLAPPED ov);
+
+			// Work that no read completion drives, returns true to be polled again on the next tick.
+			bool _poll();
+
+			// Have the reactor poll the socket, from any thread.
+			void _schedule();
+
+			void _listen();
+
+			void _pump();
+
+			void _on_header();
+
+			void _on_content(DWORD transferred);
+
+			void _read_part();
+
+			// No read in flight.
+			inline bool _idle()
+			{
+				return this->watcher.state == readstate::Unknown;
+			}
+
+			// Cancel the read in flight, content is only cancelled if asked to as the part already read is lost.
+			void _cancel(bool content);
+
+			void _unlock_reader();
+
+			std::shared_ptr<abandoned> _abandon();
+
+			std::shared_ptr<datapath::windows::task> _acquire_small_task();
+
+			void _reap_writes();
+
+			// Writes a message, try_write has reserved room for it if reserved is set.
+			datapath::error _send(std::shared_ptr<datapath::itask>& task, const char* data, size_t length,
+								  bool reserved);
+
+			// Without a message only the credit is written.
+			datapath::error _write(std::shared_ptr<datapath::itask>& task, const char* data, size_t length,
+								   const datapath::protocol::credit* credit = nullptr, bool message = true);
+
+			bool _take_credit(datapath::protocol::credit& credit, size_t divisor);
+
+			void _send_credit(const datapath::protocol::credit& credit);
+
+			void _consume(size_t length, size_t messages = 1);
+
+			void _control(const std::vector<char>& data);
+
+			datapath::error _wait_readable(std::chrono::high_resolution_clock::time_point deadline);
+
+			datapath::error _read_exact(char* data, size_t length, size_t& done,
+										std::chrono::high_resolution_clock::time_point deadline);
+
+			datapath::error _read_frame(std::vector<char>&                             buffer,
+										std::chrono::high_resolution_clock::time_point deadline);
+
+			datapath::error _receive(std::vector<char>&                             buffer,
+									 std::chrono::high_resolution_clock::time_point deadline);
+
+			void _collect(delivery& item, std::vector<char>& message);
+
+			void _deliver(delivery& item);
+
+			void _dispatch(std::vector<char>& message);
+
+			void _execute(std::function<void()> fn);
+
+			void _drain();
 
 			public:
 			socket();
@@ -63,13 +281,39 @@ namespace datapath {
 
 			virtual datapath::error close() override;
 
-			virtual datapath::error write(std::shared_ptr<datapath::itask>& task,
-										  const std::vector<char>&          data) override;
+			virtual void set_write_mode(datapath::write_mode mode) override;
+
+			virtual void set_max_message_size(size_t size, datapath::oversize_policy policy) override;
+
+			virtual void set_write_watermarks(datapath::watermark high, datapath::watermark low) override;
+
+			virtual void set_flow_control(datapath::watermark window) override;
+
+			virtual void set_dispatch(datapath::dispatch_mode                     mode,
+									  std::shared_ptr<datapath::threadpool::pool> pool) override;
+
+			using isocket::write;
+
+			virtual datapath::error write(std::shared_ptr<datapath::itask>& task, const char* data,
+										  size_t length) override;
+
+			using isocket::try_write;
+
+			virtual datapath::error try_write(std::shared_ptr<datapath::itask>& task, const char* data,
+											  size_t length) override;
+
+			virtual datapath::error receive(std::vector<char>& buffer, std::chrono::nanoseconds timeout) override;
+
+			using isocket::receive_batch;
+
+			virtual datapath::error receive_batch(std::vector<char>* buffers, size_t capacity, size_t& count,
+												  std::chrono::nanoseconds timeout) override;
 
 			public:
 			static datapath::error connect(std::shared_ptr<datapath::isocket>& socket, std::string path);
 
 			friend class datapath::windows::server;
+			friend class datapath::windows::reactor;
 		};
 	} // namespace windows
 } // namespace datapath
@@ -17,15 +17,34 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "task.hpp"
+#include "protocol.hpp"
 
-#define SIZE_ELEMENT uint32_t
-
-void datapath::windows::task::_assign(const std::vector<char>& data, std::shared_ptr<datapath::windows::overlapped> ov)
+void datapath::windows::task::_assign(const char* data, size_t length, bool message,
+									  std::shared_ptr<datapath::windows::overlapped> ov,
+									  const datapath::protocol::credit*              credit)
 {
-	this->buffer.resize(data.size() + sizeof(SIZE_ELEMENT));
-	std::memcpy(buffer.data() + sizeof(SIZE_ELEMENT), data.data(), data.size());
-	reinterpret_cast<SIZE_ELEMENT&>(buffer[0]) = SIZE_ELEMENT(data.size());
-	this->overlapped                           = ov;
+	size_t offset = 0;
+	size_t size   = (message ? (length + sizeof(SIZE_ELEMENT)) : 0);
+	if (credit) {
+		size += sizeof(SIZE_ELEMENT) + sizeof(datapath::protocol::credit);
+	}
+	this->buffer.resize(size);
+
+	if (credit) {
+		// Credit grants ride along in front of the message instead of needing their own write.
+		reinterpret_cast<SIZE_ELEMENT&>(buffer[offset]) =
+			SIZE_ELEMENT(sizeof(datapath::protocol::credit)) | CONTROL_FLAG;
+		std::memcpy(buffer.data() + offset + sizeof(SIZE_ELEMENT), credit, sizeof(datapath::protocol::credit));
+		offset += sizeof(SIZE_ELEMENT) + sizeof(datapath::protocol::credit);
+	}
+	if (message) {
+		// Empty messages are still framed, their data may be null.
+		reinterpret_cast<SIZE_ELEMENT&>(buffer[offset]) = SIZE_ELEMENT(length);
+		if (length > 0) {
+			std::memcpy(buffer.data() + offset + sizeof(SIZE_ELEMENT), data, length);
+		}
+	}
+	this->overlapped = ov;
 }
 
 datapath::windows::task::task()
@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <memory>
 #include "itask.hpp"
 #include "overlapped.hpp"
+#include "protocol.hpp"
 #include "server.hpp"
 #include "socket.hpp"
 
@@ -34,7 +35,9 @@ namespace datapath {
 			std::vector<char>                              buffer;
 
 			protected:
-			void _assign(const std::vector<char>& data, std::shared_ptr<datapath::windows::overlapped> ov);
+			void _assign(const char* data, size_t length, bool message,
+						 std::shared_ptr<datapath::windows::overlapped> ov,
+						 const datapath::protocol::credit*              credit = nullptr);
 
 			public:
 			task();
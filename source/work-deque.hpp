@@ -0,0 +1,150 @@
+/*
+ * Low Latency IPC Library for high-speed traffic
+ * Copyright (C) 2017-2019 Michael Fabian Dirks <info@xaymar.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+#pragma once
+#include <atomic>
+#include <cinttypes>
+#include <memory>
+#include <vector>
+
+namespace datapath {
+	namespace threadpool {
+		/** Work Stealing Deque
+		 * Chase-Lev deque of pointers. Only the owning thread may push() and pop(), which work on the bottom end in
+		 * LIFO order, while any thread may steal() from the top end. Grows as needed, old buffers are kept until the
+		 * deque is destroyed as a thief may still be reading from them.
+		 */
+		template<typename T>
+		class work_deque {
+			struct buffer {
+				int64_t                            capacity;
+				std::unique_ptr<std::atomic<T*>[]> items;
+
+				buffer(int64_t capacity) : capacity(capacity), items(new std::atomic<T*>[size_t(capacity)]) {}
+
+				inline T* get(int64_t idx)
+				{
+					return items[size_t(idx & (capacity - 1))].load(std::memory_order_relaxed);
+				}
+
+				inline void put(int64_t idx, T* item)
+				{
+					items[size_t(idx & (capacity - 1))].store(item, std::memory_order_relaxed);
+				}
+			};
+
+			std::atomic<int64_t>                 _top;
+			std::atomic<int64_t>                 _bottom;
+			std::atomic<buffer*>                 _buffer;
+			std::vector<std::unique_ptr<buffer>> _buffers;
+
+			buffer* _grow(buffer* current, int64_t bottom, int64_t top)
+			{
+				std::unique_ptr<buffer> next(new buffer(current->capacity * 2));
+				for (int64_t idx = top; idx < bottom; idx++) {
+					next->put(idx, current->get(idx));
+				}
+				buffer* ptr = next.get();
+				_buffers.push_back(std::move(next));
+				_buffer.store(ptr, std::memory_order_release);
+				return ptr;
+			}
+
+			public:
+			work_deque(int64_t capacity = 256) : _top(0), _bottom(0)
+			{
+				_buffers.emplace_back(new buffer(capacity));
+				_buffer.store(_buffers.back().get(), std::memory_order_relaxed);
+			}
+
+			work_deque(const work_deque<T>&) = delete;
+			work_deque<T>& operator=(const work_deque<T>&) = delete;
+
+			// Approximate number of items, may be off while other threads push or steal.
+			inline size_t size() const
+			{
+				int64_t bottom = _bottom.load(std::memory_order_relaxed);
+				int64_t top    = _top.load(std::memory_order_relaxed);
+				return bottom > top ? size_t(bottom - top) : 0;
+			}
+
+			inline bool empty() const
+			{
+				return size() == 0;
+			}
+
+			// Owner only.
+			void push(T* item)
+			{
+				int64_t bottom = _bottom.load(std::memory_order_relaxed);
+				int64_t top    = _top.load(std::memory_order_acquire);
+				buffer* buf    = _buffer.load(std::memory_order_relaxed);
+				if ((bottom - top) > (buf->capacity - 1)) {
+					buf = _grow(buf, bottom, top);
+				}
+				buf->put(bottom, item);
+				std::atomic_thread_fence(std::memory_order_release);
+				_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+
+			// Owner only, returns the most recently pushed item or nullptr.
+			T* pop()
+			{
+				int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+				buffer* buf    = _buffer.load(std::memory_order_relaxed);
+				_bottom.store(bottom, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				int64_t top = _top.load(std::memory_order_relaxed);
+
+				T* item = nullptr;
+				if (top <= bottom) {
+					item = buf->get(bottom);
+					if (top == bottom) {
+						// Last item, race thieves for it.
+						if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+														  std::memory_order_relaxed)) {
+							item = nullptr;
+						}
+						_bottom.store(bottom + 1, std::memory_order_relaxed);
+					}
+				} else {
+					_bottom.store(bottom + 1, std::memory_order_relaxed);
+				}
+				return item;
+			}
+
+			// Any thread, returns the oldest item or nullptr if empty or another thread won the race for it.
+			T* steal()
+			{
+				int64_t top = _top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				int64_t bottom = _bottom.load(std::memory_order_acquire);
+				if (top >= bottom) {
+					return nullptr;
+				}
+
+				buffer* buf  = _buffer.load(std::memory_order_acquire);
+				T*      item = buf->get(top);
+				if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					return nullptr;
+				}
+				return item;
+			}
+		};
+	} // namespace threadpool
+} // namespace datapath